@@ -0,0 +1,69 @@
+#include "arena.h"
+#include "sexp.h"
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+static const std::size_t alignment = alignof(std::max_align_t);
+
+Arena::Arena(Arena &&other) : next(nullptr), limit(nullptr) {
+  swap(*this, other);
+}
+
+Arena &Arena::operator=(Arena other) {
+  swap(*this, other);
+  return *this;
+}
+
+void *Arena::allocate(std::size_t size) {
+  // round up so the next allocation stays aligned
+  size = (size + alignment - 1) & ~(alignment - 1);
+  if (next == nullptr || size > std::size_t(limit - next)) {
+    // start a new chunk: oversized requests get a chunk of their own
+    std::size_t bytes = size > chunk_size ? size : chunk_size;
+    char *mem = static_cast<char *>(std::malloc(bytes));
+    if (!mem) {
+      throw std::bad_alloc();
+    }
+    auto at = std::upper_bound(
+        chunks.begin(), chunks.end(), mem,
+        [](const char *p, const Chunk &chunk) { return p < chunk.begin; });
+    chunks.insert(at, Chunk{mem, mem + bytes});
+    next = mem;
+    limit = mem + bytes;
+  }
+  void *result = next;
+  next += size;
+  return result;
+}
+
+bool Arena::contains(const void *ptr) const {
+  const char *p = static_cast<const char *>(ptr);
+  // the only chunk which could hold p is the last one starting at or below it
+  auto after = std::upper_bound(
+      chunks.begin(), chunks.end(), p,
+      [](const char *p, const Chunk &chunk) { return p < chunk.begin; });
+  return after != chunks.begin() && p < (after - 1)->end;
+}
+
+std::size_t Arena::capacity() const {
+  std::size_t total = 0;
+  for (auto it = chunks.begin(); it != chunks.end(); ++it) {
+    total += it->end - it->begin;
+  }
+  return total;
+}
+
+void Arena::clear() {
+  for (auto it = chunks.begin(); it != chunks.end(); ++it) {
+    std::free(it->begin);
+  }
+  chunks.clear();
+  next = limit = nullptr;
+}
+
+CodeArena::~CodeArena() {
+  for (auto it = objects.rbegin(); it != objects.rend(); ++it) {
+    (*it)->~SExp();
+  }
+}
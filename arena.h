@@ -0,0 +1,88 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+class SExp;
+
+/*
+An arena hands out memory from a few large contiguous chunks, by bumping a
+pointer through the current chunk. Objects allocated together therefore end
+up next to each other in memory, which is what the copying collector relies
+on to lay live data out in the order it is traversed.
+
+The arena only manages the raw memory: whoever constructs objects in it is
+responsible for calling their destructors before the arena is cleared.
+*/
+
+class Arena {
+private:
+  struct Chunk {
+    char *begin;
+    char *end;
+  };
+  // in address order, so that contains can search them by halves
+  std::vector<Chunk> chunks;
+  char *next;  // first free byte in the current chunk
+  char *limit; // end of the current chunk
+  void swap(Arena &a, Arena &b) {
+    std::swap(a.chunks, b.chunks);
+    std::swap(a.next, b.next);
+    std::swap(a.limit, b.limit);
+  }
+
+public:
+  static const std::size_t chunk_size = 1 << 20;
+
+  // return size bytes of suitably aligned memory
+  void *allocate(std::size_t size);
+  // test whether ptr points into memory handed out by this arena
+  bool contains(const void *ptr) const;
+  // total bytes reserved by the arena
+  std::size_t capacity() const;
+  // release all the memory held by the arena
+  void clear();
+
+  Arena() : next(nullptr), limit(nullptr) {}
+  Arena(Arena &&other);
+  Arena &operator=(Arena);
+  Arena(const Arena &) = delete;
+  ~Arena() { clear(); }
+};
+
+/*
+The code arena holds the expressions the parser builds from program text.
+These live as long as the interpreter, so the garbage collector never
+sweeps or traces them, and the cost of a collection depends on the data a
+program uses rather than on how long the program is. Code is never
+modified, and it only refers to other code, so data which refers to code
+(like the result of quote) is safe to collect around it.
+*/
+
+class CodeArena {
+private:
+  Arena arena;
+  std::vector<SExp *> objects; // kept so they can be destroyed
+
+public:
+  // construct a T in the arena from args
+  template <typename T, typename... Args> T *make(Args &&... args) {
+    T *obj = new (arena.allocate(sizeof(T))) T(std::forward<Args>(args)...);
+    objects.push_back(obj);
+    return obj;
+  }
+  bool contains(const void *ptr) const { return arena.contains(ptr); }
+  std::size_t size() const { return objects.size(); }
+
+  CodeArena() {}
+  CodeArena(CodeArena &&) = default;
+  CodeArena &operator=(CodeArena &&) = default;
+  CodeArena(const CodeArena &) = delete;
+  CodeArena &operator=(const CodeArena &) = delete;
+  ~CodeArena();
+};
+
+#endif
@@ -0,0 +1,31 @@
+;;Examples of evaluation budgets, to be typed at the repl with a limit of each kind:
+;;	./main --workers 4 --max-steps 40000 --max-depth 100 --max-alloc 64M --timeout 2000 < budget-test.lisp
+;;make budget-test does this. Each limit is small enough that one expression below goes over it,
+;;and the expression after it shows the interpreter carries on as usual
+
+(define tree (lambda (n) (if (= n 0) 1 (+ (tree (- n 1)) (tree (- n 1))))))
+(define count-down (lambda (n) (if (= n 0) 0 (count-down (- n 1)))))
+
+;; steps: (tree 14) takes about 130000 of them, and (tree 12) about 33000
+(tree 14)
+(tree 12)
+
+;; the tasks of a parallel primitive, on four threads here, share what is left: each (tree 12)
+;; fits on its own, but not all four together
+(pmap tree (list 12 12 12 12))
+(pmap tree (list 10 10 10 10))
+
+;; depth
+(count-down 1000)
+(count-down 50)
+
+;; bytes
+(make-bytevector 128000000)
+(bytevector-length (make-bytevector 1000))
+
+;; time: each call of soak at the bottom reads 32 megabytes, so it takes a while without taking many steps
+(define zeros (open-input-port "/dev/zero"))
+(define block (make-bytevector 32000000))
+(define soak (lambda (n) (if (= n 0) (read-bytes block zeros) (+ (soak (- n 1)) (soak (- n 1))))))
+(soak 11)
+(soak 2)
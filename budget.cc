@@ -0,0 +1,96 @@
+#include "budget.h"
+#include <algorithm>
+
+// the clock is read this often, in steps, when there's a time limit
+static const std::size_t clock_interval = 4096;
+// steps are added to a shared count this often
+static const std::size_t share_interval = 4096;
+
+thread_local Budget *Budget::current = nullptr;
+
+Budget::Budget(const Limits &limits, SharedCounts *shared)
+    : limits(limits), steps(0), bytes(0), depth(0), outer(current),
+      shared(shared), steps_shared(0) {
+  if (limits.time.count()) {
+    deadline = std::chrono::steady_clock::now() + limits.time;
+  }
+  plan_check();
+  current = this;
+}
+
+Budget::~Budget() {
+  if (shared) {
+    share_steps();
+  }
+  current = outer;
+}
+
+void Budget::plan_check() {
+  next_check = limits.time.count() ? steps + clock_interval : ~std::size_t(0);
+  if (shared && limits.steps) {
+    // the others' steps only show up in the shared count
+    next_check = std::min(next_check, steps + share_interval);
+  } else if (limits.steps) {
+    next_check = std::min(next_check, limits.steps + 1);
+  }
+}
+
+void Budget::share_steps() {
+  shared->steps += steps - steps_shared;
+  steps_shared = steps;
+}
+
+std::size_t Budget::steps_counted() const {
+  return shared ? shared->steps + (steps - steps_shared) : steps;
+}
+
+std::size_t Budget::bytes_counted() const {
+  return shared ? shared->bytes.load() : bytes;
+}
+
+void Budget::checkpoint() {
+  if (shared) {
+    share_steps();
+  }
+  if (limits.steps && steps_counted() > limits.steps) {
+    throw budget_exceeded("more than " + std::to_string(limits.steps) +
+                          " steps taken");
+  }
+  if (limits.time.count() && std::chrono::steady_clock::now() > deadline) {
+    throw budget_exceeded("more than " + std::to_string(limits.time.count()) +
+                          "ms taken");
+  }
+  plan_check();
+}
+
+// a limit which has been used up is left at one, rather than zero, which
+// would mean no limit at all
+Limits Budget::remaining() const {
+  Limits left;
+  std::size_t steps = steps_counted();
+  std::size_t bytes = bytes_counted();
+  if (limits.steps) {
+    left.steps = limits.steps > steps ? limits.steps - steps : 1;
+  }
+  if (limits.bytes) {
+    left.bytes = limits.bytes > bytes ? limits.bytes - bytes : 1;
+  }
+  if (limits.depth) {
+    left.depth = limits.depth > depth ? limits.depth - depth : 1;
+  }
+  if (limits.time.count()) {
+    auto now = std::chrono::steady_clock::now();
+    left.time = std::max(
+        std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now),
+        std::chrono::milliseconds(1));
+  }
+  return left;
+}
+
+void Budget::charge(std::size_t more_steps, std::size_t more_bytes) {
+  steps += more_steps;
+  allocate(more_bytes);
+  if (steps >= next_check) {
+    checkpoint();
+  }
+}
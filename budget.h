@@ -0,0 +1,143 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include "lisp_exceptions.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+/*
+A budget limits how much work an evaluation may do, so that a program which
+loops forever or allocates without end is stopped rather than holding up
+everything else. It counts four things:
+  steps: function applications evaluated
+  bytes: bytes of objects the heap is asked to manage
+  depth: calls of lisp functions which haven't returned yet
+  time:  wall clock time since the budget was made
+Going past any of the limits raises budget_exceeded from wherever the
+evaluation has got to. It unwinds like any other error, so the interpreter
+is left as it would be after an evaluation_error, and can carry on.
+
+A budget counts whatever is evaluated on the thread which made it, until it
+is destroyed, so budgets are made and destroyed in nested order. The counts
+are plain integers: a step costs an increment and a comparison, and the
+clock is only read every few thousand steps. A limit of 0 means no limit.
+
+Work done on other threads, by parallel primitives or spawned interpreters,
+gets a budget of its own holding whatever the budget that started it had
+left. The budgets of the tasks of a parallel primitive share their step and
+byte counts, so that together they stay within what was left: bytes are
+added to the shared count as they are allocated, and steps every few
+thousand, so the tasks can only go over by that many steps each. What they
+used is charged to the starting budget once they're done.
+*/
+
+struct Limits {
+  std::size_t steps = 0;
+  std::size_t bytes = 0;
+  std::size_t depth = 0;
+  std::chrono::milliseconds time{0};
+  bool any() const { return steps || bytes || depth || time.count(); }
+};
+
+// the counts shared by budgets working in parallel
+struct SharedCounts {
+  std::atomic<std::size_t> steps{0};
+  std::atomic<std::size_t> bytes{0};
+};
+
+class Budget {
+private:
+  Limits limits;
+  std::size_t steps;
+  std::size_t next_check; // the step count to check the limits at
+  std::size_t bytes;
+  std::size_t depth;
+  std::chrono::steady_clock::time_point deadline;
+  Budget *outer;        // the budget this one took over from
+  SharedCounts *shared; // the counts limits applies to, if they're shared
+  std::size_t steps_shared; // how many of steps have been added to shared
+  static thread_local Budget *current;
+  // work out when the limits next need checking
+  void plan_check();
+  // called once steps reaches next_check
+  void checkpoint();
+  // add the steps taken since last time to the shared count
+  void share_steps();
+  // the counts limits applies to
+  std::size_t steps_counted() const;
+  std::size_t bytes_counted() const;
+
+public:
+  // count evaluation on this thread against limits. If shared is given,
+  // the limits apply to its counts, which other budgets add to as well
+  explicit Budget(const Limits &limits, SharedCounts *shared = nullptr);
+  // hand the thread back to the budget which was counting before
+  ~Budget();
+  Budget(const Budget &) = delete;
+  Budget &operator=(const Budget &) = delete;
+  // the budget counting on this thread, if any
+  static Budget *active() { return current; }
+  // what is left, for work done on another thread
+  Limits remaining() const;
+
+  void step() {
+    if (++steps >= next_check) {
+      checkpoint();
+    }
+  }
+  void allocate(std::size_t n) {
+    bytes += n;
+    std::size_t counted = shared ? shared->bytes += n : bytes;
+    if (limits.bytes && counted > limits.bytes) {
+      throw budget_exceeded("more than " + std::to_string(limits.bytes) +
+                            " bytes allocated");
+    }
+  }
+  // throw budget_exceeded if allocating n more bytes would, without counting
+  // them
+  void check_allocation(std::size_t n) const {
+    std::size_t counted = shared ? shared->bytes.load() : bytes;
+    if (limits.bytes && n > limits.bytes - std::min(counted, limits.bytes)) {
+      throw budget_exceeded("more than " + std::to_string(limits.bytes) +
+                            " bytes allocated");
+    }
+  }
+  // add the steps and bytes used by work done on other threads
+  void charge(std::size_t more_steps, std::size_t more_bytes);
+  void enter() {
+    if (++depth > limits.depth && limits.depth) {
+      --depth;
+      throw budget_exceeded("calls nested more than " +
+                            std::to_string(limits.depth) + " deep");
+    }
+  }
+  void leave() {
+    if (depth > 0) {
+      --depth;
+    }
+  }
+
+  // counts a function call against the depth limit of whichever budget is
+  // active, for as long as it is on the stack. A coroutine can outlive the
+  // budget it was started under, so it doesn't hold on to the budget itself
+  class Frame {
+  public:
+    Frame() {
+      if (current) {
+        current->enter();
+      }
+    }
+    ~Frame() {
+      if (current) {
+        current->leave();
+      }
+    }
+    Frame(const Frame &) = delete;
+    Frame &operator=(const Frame &) = delete;
+  };
+};
+
+#endif
@@ -0,0 +1,54 @@
+;;Suspended coroutines while the heap is collected, to be run with a small heap:
+;;	./main --max-heap 16M coroutine-gc-test.lisp
+;;make coroutine-gc-test does this, with each collector. Each line below makes a megabyte
+;;of garbage, so the heap is collected many times while both coroutines are part way
+;;through, and the values they are holding on their stacks have to survive it
+
+(define naturals (make-coroutine (lambda ()
+	((lambda (loop) (loop loop 0))
+	 (lambda (loop n) (yield n) (loop loop (+ n 1)))))))
+(define holder (make-coroutine (lambda ()
+	(list (list "made before" "yielding") (yield 0) (list "made after")))))
+(resume holder 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(bytevector-length (make-bytevector 1000000)) (resume naturals 0)
+(displayln (resume naturals 0))
+(displayln (resume holder "resumed"))
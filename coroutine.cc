@@ -0,0 +1,419 @@
+#include "coroutine.h"
+#include "pool.h"
+#include "sexp.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__SANITIZE_ADDRESS__)
+#define TRACK_STACKS
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define TRACK_STACKS
+#endif
+#endif
+#ifdef TRACK_STACKS
+#include <sanitizer/common_interface_defs.h>
+#endif
+
+// Programs loop by recursing, so stacks are reserved at the size a main
+// thread usually gets, but pages are only given memory as the coroutine
+// reaches them. The lowest page is left unmapped, so running off the end
+// faults rather than overwriting something else
+static const std::size_t stack_size = 8 << 20;
+static const std::size_t guard_size = 1 << 12;
+
+// the coroutine running on this thread, and the scheduler running it
+static thread_local CoroutineState *running = nullptr;
+static thread_local Scheduler *scheduler = nullptr;
+
+namespace {
+// thrown from the yield of a coroutine being cancelled, and caught by cancel
+struct Cancelled {};
+} // namespace
+
+#if defined(__x86_64__)
+// A switch pushes the registers a called function has to preserve onto the
+// stack it is leaving, stores the stack pointer in *from, then loads to and
+// pops the registers saved on that stack, returning to wherever it last
+// switched away. Unlike swapcontext, it doesn't save and restore the signal
+// mask, which is a system call each time. Nothing changes the floating
+// point control words, so they aren't saved either.
+extern "C" void lisp_switch_stack(void **from, void *to);
+asm(R"(
+  .pushsection .text
+  .globl lisp_switch_stack
+  .type lisp_switch_stack, @function
+lisp_switch_stack:
+  pushq %rbp
+  pushq %rbx
+  pushq %r12
+  pushq %r13
+  pushq %r14
+  pushq %r15
+  movq %rsp, (%rdi)
+  movq %rsi, %rsp
+  popq %r15
+  popq %r14
+  popq %r13
+  popq %r12
+  popq %rbx
+  popq %rbp
+  ret
+  .size lisp_switch_stack, .-lisp_switch_stack
+  .popsection
+)");
+
+// lay out a new stack as if it had switched away just before calling entry
+static void make_context(StackContext &ctx, void *stack, std::size_t size,
+                         void (*entry)()) {
+  auto top = (reinterpret_cast<std::uintptr_t>(stack) + size) &
+             ~std::uintptr_t(15);
+  void **sp = reinterpret_cast<void **>(top);
+  *--sp = nullptr; // entry's return address: it never returns
+  *--sp = reinterpret_cast<void *>(entry);
+  for (int i = 0; i < 6; ++i) {
+    *--sp = nullptr; // the saved registers
+  }
+  ctx.sp = sp;
+}
+
+static void switch_context(StackContext &from, StackContext &to) {
+  lisp_switch_stack(&from.sp, to.sp);
+}
+#else
+static void make_context(StackContext &ctx, void *stack, std::size_t size,
+                         void (*entry)()) {
+  getcontext(&ctx.uc);
+  ctx.uc.uc_stack.ss_sp = stack;
+  ctx.uc.uc_stack.ss_size = size;
+  ctx.uc.uc_link = nullptr;
+  makecontext(&ctx.uc, entry, 0);
+}
+
+static void switch_context(StackContext &from, StackContext &to) {
+  swapcontext(&from.uc, &to.uc);
+}
+#endif
+
+// AddressSanitizer has to be told which stack is about to run, and which
+// one ran before, or it takes the switch for an overflow. A stack which
+// won't run again passes no fake_stack
+static void leaving(void **fake_stack, const void *bottom, std::size_t size) {
+#ifdef TRACK_STACKS
+  __sanitizer_start_switch_fiber(fake_stack, bottom, size);
+#endif
+}
+
+static void arrived(void *fake_stack, const void **bottom, std::size_t *size) {
+#ifdef TRACK_STACKS
+  __sanitizer_finish_switch_fiber(fake_stack, bottom, size);
+#endif
+}
+
+CoroutineState::CoroutineState(GlobalEnv &env, SExp *fn)
+    : env(env), status(Status::created), stack(nullptr),
+      caller_stack(nullptr), caller_stack_size(0), resumer(nullptr),
+      transfer(nullptr), cancelled(false), fn(fn) {}
+
+void CoroutineState::free_stack() {
+  if (stack) {
+    munmap(stack, stack_size);
+    stack = nullptr;
+  }
+}
+
+// the first thing run on a coroutine's stack. Errors can't be thrown past
+// here, so they are passed back to the resume instead
+void CoroutineState::start() {
+  CoroutineState *self = running;
+  arrived(nullptr, &self->caller_stack, &self->caller_stack_size);
+  try {
+    Function *func = dynamic_cast<Function *>(self->fn);
+    hold(self->fn);
+    self->fn = nullptr;
+    self->transfer = func->call(std::list<SExp *>(), self->env);
+  } catch (...) {
+    self->error = std::current_exception();
+  }
+  self->status = Status::finished;
+  leaving(nullptr, self->caller_stack, self->caller_stack_size);
+  switch_context(self->context, self->caller);
+}
+
+SExp *CoroutineState::resume(SExp *value) {
+  if (status == Status::finished) {
+    throw evaluation_error("Cannot resume a coroutine which has returned");
+  }
+  if (status == Status::running) {
+    throw evaluation_error("Cannot resume a coroutine which is running");
+  }
+  // while an interpreter is layered over env, whatever the coroutine made
+  // would belong to the layer, and be left on its stack when the layer goes
+  if (&env.get_global() != &env) {
+    throw evaluation_error(
+        "Cannot resume a coroutine of an interpreter with a layer over it");
+  }
+  if (status == Status::created) {
+    stack = mmap(nullptr, stack_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1,
+                 0);
+    if (stack == MAP_FAILED) {
+      stack = nullptr;
+      throw evaluation_error("Couldn't allocate a stack for a coroutine");
+    }
+    mprotect(stack, guard_size, PROT_NONE);
+    make_context(context, stack, stack_size, &CoroutineState::start);
+    env.coroutine_started(this);
+  }
+  status = Status::running;
+  transfer = value;
+  resumer = running;
+  running = this;
+  void *fake_stack;
+  leaving(&fake_stack, stack, stack_size);
+  switch_context(caller, context);
+  arrived(fake_stack, nullptr, nullptr);
+  running = resumer;
+  if (status == Status::finished) {
+    free_stack();
+    env.coroutine_finished(this);
+    if (error) {
+      std::exception_ptr raised = error;
+      error = nullptr;
+      std::rethrow_exception(raised);
+    }
+  } else {
+    status = Status::suspended;
+  }
+  hold(transfer);
+  return transfer;
+}
+
+SExp *CoroutineState::yield(SExp *value) {
+  CoroutineState *self = running;
+  if (!self) {
+    throw evaluation_error("Cannot yield outside a coroutine");
+  }
+  // the threads of a parallel primitive would be left waiting on a stack
+  // which isn't running
+  if (WorkPool::on_worker()) {
+    throw evaluation_error("Cannot yield inside a parallel primitive");
+  }
+  self->transfer = value;
+  void *fake_stack;
+  leaving(&fake_stack, self->caller_stack, self->caller_stack_size);
+  switch_context(self->context, self->caller);
+  arrived(fake_stack, &self->caller_stack, &self->caller_stack_size);
+  if (self->cancelled) {
+    throw Cancelled();
+  }
+  hold(self->transfer);
+  return self->transfer;
+}
+
+void CoroutineState::hold(SExp *value) {
+  if (running && value) {
+    running->held.push_back(value);
+  }
+}
+
+CoroutineState::Frame::Frame(Env &scope)
+    : co(running), mark(0), result(nullptr) {
+  if (co) {
+    mark = co->held.size();
+    co->frames.push_back(&scope);
+  }
+}
+
+CoroutineState::Frame::~Frame() {
+  if (co) {
+    co->held.resize(mark);
+    co->frames.pop_back();
+    if (result) {
+      co->held.push_back(result);
+    }
+  }
+}
+
+void CoroutineState::cancel() {
+  if (status != Status::suspended || &env.get_global() != &env) {
+    return;
+  }
+  cancelled = true;
+  try {
+    resume(nullptr);
+  } catch (const Cancelled &) {
+  }
+}
+
+Scheduler::Scheduler(Env &env)
+    : poller(-1), current{nullptr, nullptr}, current_state(nullptr),
+      parked(false), null(env.lookup("null")) {}
+
+Scheduler::~Scheduler() {
+  if (poller >= 0) {
+    ::close(poller);
+  }
+}
+
+void Scheduler::schedule(SExp *coroutine, SExp **result) {
+  ready.push_back(Task{coroutine, result});
+}
+
+Scheduler *Scheduler::active() { return scheduler; }
+
+void Scheduler::run() {
+  Scheduler *outer = scheduler;
+  scheduler = this;
+  try {
+    while (!ready.empty() || !waiting.empty()) {
+      if (ready.empty()) {
+        poll();
+        continue;
+      }
+      Task next = ready.front();
+      ready.pop_front();
+      CoroutineState &co = *static_cast<Coroutine *>(next.coroutine)->state;
+      if (co.finished()) {
+        continue; // something else resumed it to the end
+      }
+      current = next;
+      current_state = &co;
+      parked = false;
+      SExp *value = co.resume(null);
+      current_state = nullptr;
+      if (parked) {
+        continue; // poll will make it ready again
+      } else if (!co.finished()) {
+        ready.push_back(next);
+      } else if (next.result) {
+        *next.result = value;
+      }
+    }
+  } catch (...) {
+    current_state = nullptr;
+    scheduler = outer;
+    cancel_all();
+    throw;
+  }
+  scheduler = outer;
+}
+
+void Scheduler::cancel_all() {
+  std::vector<SExp *> left;
+  for (auto it = ready.begin(); it != ready.end(); ++it) {
+    left.push_back(it->coroutine);
+  }
+  for (auto it = waiting.begin(); it != waiting.end(); ++it) {
+    if (it->second.reader.coroutine) {
+      left.push_back(it->second.reader.coroutine);
+    }
+    if (it->second.writer.coroutine) {
+      left.push_back(it->second.writer.coroutine);
+    }
+  }
+  ready.clear();
+  waiting.clear();
+  for (auto it = left.begin(); it != left.end(); ++it) {
+    static_cast<Coroutine *>(*it)->state->cancel();
+  }
+}
+
+// the descriptor is watched for whatever its waiting coroutines need
+static void watch(int poller, int fd, bool reader, bool writer, int op) {
+  struct epoll_event event;
+  event.events = (reader ? EPOLLIN : 0) | (writer ? EPOLLOUT : 0);
+  event.data.fd = fd;
+  if (epoll_ctl(poller, op, fd, &event) < 0 && op != EPOLL_CTL_DEL) {
+    throw io_error("Cannot wait for port: " + std::string(strerror(errno)));
+  }
+}
+
+bool Scheduler::park(int fd, bool write) {
+  if (poller < 0) {
+    poller = epoll_create1(EPOLL_CLOEXEC);
+    if (poller < 0) {
+      throw io_error("Cannot create an event loop: " +
+                     std::string(strerror(errno)));
+    }
+  }
+  auto found = waiting.find(fd);
+  if (found == waiting.end()) {
+    struct epoll_event event;
+    event.events = write ? EPOLLOUT : EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(poller, EPOLL_CTL_ADD, fd, &event) < 0) {
+      if (errno == EPERM) {
+        return false; // a regular file, which is never held up
+      }
+      throw io_error("Cannot wait for port: " + std::string(strerror(errno)));
+    }
+    found = waiting.emplace(fd, Waiting()).first;
+  } else {
+    Task &slot = write ? found->second.writer : found->second.reader;
+    if (slot.coroutine) {
+      throw io_error("Another coroutine is already waiting on this port");
+    }
+    // the other slot is taken, or the descriptor wouldn't be watched
+    watch(poller, fd, true, true, EPOLL_CTL_MOD);
+  }
+  (write ? found->second.writer : found->second.reader) = current;
+  parked = true;
+  return true;
+}
+
+void Scheduler::poll() {
+  struct epoll_event events[64];
+  int n;
+  do {
+    n = epoll_wait(poller, events, 64, -1);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    throw io_error("Error waiting for ports: " + std::string(strerror(errno)));
+  }
+  for (int i = 0; i < n; ++i) {
+    int fd = events[i].data.fd;
+    Waiting &w = waiting[fd];
+    // an error or hang up wakes both, so they find out from the port
+    std::uint32_t broken = EPOLLHUP | EPOLLERR;
+    if (w.reader.coroutine && (events[i].events & (EPOLLIN | broken))) {
+      ready.push_back(w.reader);
+      w.reader = Task{nullptr, nullptr};
+    }
+    if (w.writer.coroutine && (events[i].events & (EPOLLOUT | broken))) {
+      ready.push_back(w.writer);
+      w.writer = Task{nullptr, nullptr};
+    }
+    if (!w.reader.coroutine && !w.writer.coroutine) {
+      watch(poller, fd, false, false, EPOLL_CTL_DEL);
+      waiting.erase(fd);
+    } else {
+      watch(poller, fd, w.reader.coroutine, w.writer.coroutine,
+            EPOLL_CTL_MOD);
+    }
+  }
+}
+
+// only the coroutine the scheduler resumed can yield back to it
+bool Scheduler::running_scheduled() {
+  return scheduler && running && running == scheduler->current_state &&
+         !WorkPool::on_worker();
+}
+
+void Scheduler::wait_for(int fd, bool write) {
+  Scheduler *self = scheduler;
+  if (running_scheduled() && self->park(fd, write)) {
+    CoroutineState::yield(self->null);
+    return;
+  }
+  struct pollfd p;
+  p.fd = fd;
+  p.events = write ? POLLOUT : POLLIN;
+  while (::poll(&p, 1, -1) < 0 && errno == EINTR) {
+  }
+}
@@ -0,0 +1,207 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include "env.h"
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <unordered_map>
+#include <vector>
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+/*
+A coroutine is a function call which can stop part way through, with
+yield, and be carried on later from the same point, with resume. Each one
+has a C++ stack of its own, mapped when it first runs and unmapped when it
+returns, and switching between it and whatever resumed it is a swap of
+stack pointers rather than a system thread switch (see switch_context in
+coroutine.cc). Only the pages of a
+stack which are used take up memory, so tens of thousands of coroutines can
+be suspended at once.
+
+Values are passed both ways: (resume co x) makes the yield co is waiting in
+return x, and (yield y) makes the resume return y. When the function
+returns, the resume gives its value, and the coroutine is finished. An
+error raised inside a coroutine comes out of the resume that ran it.
+
+Each stack is two mappings, since the guard page at its bottom is
+protected differently from the rest, and Linux allows a process
+vm.max_map_count mappings, 65530 by default. So only about 32 thousand
+coroutines can be part way through at once unless that is raised.
+
+The values a suspended coroutine is using are on its stack, which the
+collector can't see, so the coroutine keeps a list of them: everything made
+or looked up by each call it is part way through, and the scopes of those
+calls (see CoroutineState::Frame). When a call returns, what it held is
+dropped, apart from its result, which its caller holds instead. The
+collector reaches these through the coroutine, so they live as long as it
+can be resumed. Their addresses are on the stack, though, so the copying
+collector marks and sweeps in place instead while any coroutine is part way
+through. Once a suspended coroutine can't be reached from the globals,
+nothing can resume it again, so when a collection is due it is finished off:
+it is resumed one last time, with its yield raising an error which unwinds
+its stack without running any more of it.
+
+A coroutine made by an interpreter can't be resumed while another is
+layered over it, such as a served program over its prelude: what it made
+would belong to the layer, and still be on its stack once the layer is
+gone.
+
+A scheduler takes turns resuming a set of coroutines, each of which runs
+until it yields or returns, until all of them have returned. Coroutines it
+runs can add more to it with schedule. If one of them raises an error, the
+others are finished off, as above, and the error comes out of the scheduler.
+
+The scheduler is also an event loop. Pipe and socket ports don't block:
+when one of the coroutines it is running reads from a port with nothing
+waiting to be read, or writes to one which is full, the coroutine is put
+aside and the others carry on. Once none of them can run, the scheduler
+waits, with epoll, for one of the ports they are waiting on to be ready,
+and carries on with the coroutines it was holding up. Anything else which
+waits on a port, like the top level or a coroutine resumed by hand, just
+blocks until the port is ready. A coroutine keeps its port locked while it
+waits, so another coroutine on the same thread using that port raises an
+io-error rather than waiting for it.
+
+Channels can't be waited on this way. Their waits block the whole thread,
+holding up the other coroutines, which may be the ones that would fill or
+empty the channel. So a coroutine the scheduler is running raises an error
+rather than wait for a channel which is empty or full.
+*/
+
+// a stack which has been switched away from, and where it carries on from
+#if defined(__x86_64__)
+struct StackContext {
+  void *sp; // its stack pointer, with its registers saved just above
+};
+#else
+struct StackContext {
+  ucontext_t uc;
+};
+#endif
+
+class CoroutineState {
+private:
+  enum class Status { created, running, suspended, finished };
+  GlobalEnv &env;
+  Status status;
+  StackContext context; // where the coroutine carries on from
+  StackContext caller;  // where its last resume carries on from
+  void *stack;
+  // the stack of whatever last resumed it, which only AddressSanitizer
+  // needs to know
+  const void *caller_stack;
+  std::size_t caller_stack_size;
+  CoroutineState *resumer; // the coroutine running the last resume, if any
+  SExp *transfer;          // the value being passed across a switch
+  std::exception_ptr error;
+  bool cancelled; // whether its yield should unwind the stack
+  // values its stack may refer to, and the scopes of the calls on it
+  std::vector<SExp *> held;
+  std::vector<Env *> frames;
+  static void start();
+  void free_stack();
+
+public:
+  SExp *fn; // the function to call, until it has been called
+  CoroutineState(GlobalEnv &env, SExp *fn);
+  // run the coroutine until it yields or returns, passing it value
+  SExp *resume(SExp *value);
+  bool finished() const { return status == Status::finished; }
+  // whether it has started and not returned
+  bool suspended() const {
+    return status == Status::suspended || status == Status::running;
+  }
+  // finish a suspended coroutine by unwinding its stack, without running
+  // any more of it
+  void cancel();
+  // suspend the coroutine running on this thread, passing value to whatever
+  // resumed it, and return the value it is next resumed with
+  static SExp *yield(SExp *value);
+  // keep value alive until the call running on this thread's coroutine
+  // returns. Outside a coroutine it does nothing
+  static void hold(SExp *value);
+  // call f on every value a suspended coroutine's stack may refer to
+  template <typename F> void for_each_held(F f) const {
+    if (status != Status::suspended) {
+      return;
+    }
+    for (auto it = held.begin(); it != held.end(); ++it) {
+      f(*it);
+    }
+    for (auto frame = frames.begin(); frame != frames.end(); ++frame) {
+      for (auto it = (*frame)->scope.begin(); it != (*frame)->scope.end();
+           ++it) {
+        f(it->second);
+      }
+    }
+  }
+  // Made for each function call, this adds the call's scope to what the
+  // running coroutine holds, and drops what the call held when it returns,
+  // apart from its result
+  class Frame {
+  private:
+    CoroutineState *co;
+    std::size_t mark;
+    SExp *result;
+
+  public:
+    explicit Frame(Env &scope);
+    // the call is returning value, which its caller holds from now on
+    SExp *returning(SExp *value) { return result = value; }
+    ~Frame();
+  };
+  ~CoroutineState() { free_stack(); }
+};
+
+class Scheduler {
+private:
+  // a coroutine, with where its result goes
+  struct Task {
+    SExp *coroutine;
+    SExp **result;
+  };
+  // the coroutines held up reading from and writing to a descriptor
+  struct Waiting {
+    Task reader{nullptr, nullptr};
+    Task writer{nullptr, nullptr};
+  };
+  std::deque<Task> ready; // coroutines waiting for a turn
+  std::unordered_map<int, Waiting> waiting;
+  int poller; // the epoll descriptor, once a coroutine has had to wait
+  Task current;
+  CoroutineState *current_state; // the coroutine running, if any
+  bool parked; // whether the current coroutine is waiting on a descriptor
+  SExp *null;
+  // put the current coroutine aside until fd is ready. Returns false if fd
+  // can't be waited on, because it is always ready
+  bool park(int fd, bool write);
+  // wait for at least one parked coroutine's descriptor to be ready, and
+  // make the coroutines it was holding up ready to run
+  void poll();
+  // finish off the coroutines still to run, after one has raised an error
+  void cancel_all();
+
+public:
+  Scheduler(Env &env);
+  // add a coroutine, storing its value in result when it returns
+  void schedule(SExp *coroutine, SExp **result = nullptr);
+  // take turns resuming the coroutines until they have all returned
+  void run();
+  // the scheduler which is running coroutines on this thread, if any
+  static Scheduler *active();
+  // wait until fd can be read from, or written to if write is true. A
+  // coroutine which the active scheduler is running lets the others run
+  // meanwhile
+  static void wait_for(int fd, bool write);
+  // whether the coroutine running on this thread is one the active scheduler
+  // resumed, which lets the others run while it waits
+  static bool running_scheduled();
+  Scheduler(const Scheduler &) = delete;
+  Scheduler &operator=(const Scheduler &) = delete;
+  ~Scheduler();
+};
+
+#endif
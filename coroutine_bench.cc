@@ -0,0 +1,75 @@
+/*
+Measures the cost of switching to a coroutine and back, without evaluating
+anything in between, and of the same round trip made with swapcontext.
+  make coroutine_bench && ./coroutine_bench [switches]
+*/
+#include "coroutine.h"
+#include "env.h"
+#include "sexp.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <ucontext.h>
+#include <vector>
+
+static long rounds;
+
+// nanoseconds per round trip, over count round trips made by f
+template <typename F> double time_rounds(long count, F f) {
+  auto start = std::chrono::steady_clock::now();
+  f(count);
+  std::chrono::duration<double, std::nano> taken =
+      std::chrono::steady_clock::now() - start;
+  return taken.count() / count;
+}
+
+static ucontext_t main_context, bench_context;
+
+static void ping() {
+  for (long i = 0; i < rounds; ++i) {
+    swapcontext(&bench_context, &main_context);
+  }
+  swapcontext(&bench_context, &main_context);
+}
+
+int main(int argc, char *argv[]) {
+  rounds = argc > 1 ? std::strtol(argv[1], nullptr, 10) : 1000000;
+  GlobalEnv env;
+
+  // a coroutine whose function is a builtin which yields straight back
+  SExp *yielder = env.manage(new PrimitiveFunction(
+      [](std::list<SExp *> &args, Env &env) -> SExp * {
+        for (long i = 0; i < rounds; ++i) {
+          CoroutineState::yield(nullptr);
+        }
+        return env.lookup("null");
+      },
+      "yielder"));
+  CoroutineState coroutine(env, yielder);
+  coroutine.resume(nullptr); // map its stack before timing
+  double switched = time_rounds(rounds - 1, [&](long count) {
+    for (long i = 0; i < count; ++i) {
+      coroutine.resume(nullptr);
+    }
+  });
+  coroutine.resume(nullptr);
+
+  std::vector<char> stack(1 << 16);
+  getcontext(&bench_context);
+  bench_context.uc_stack.ss_sp = stack.data();
+  bench_context.uc_stack.ss_size = stack.size();
+  bench_context.uc_link = nullptr;
+  makecontext(&bench_context, ping, 0);
+  double swapped = time_rounds(rounds, [&](long count) {
+    for (long i = 0; i < count; ++i) {
+      swapcontext(&main_context, &bench_context);
+    }
+  });
+  swapcontext(&main_context, &bench_context);
+
+  std::cout << "nanoseconds per resume and yield, over " << rounds
+            << " round trips\n"
+            << "  coroutine:   " << switched << "\n"
+            << "  swapcontext: " << swapped << std::endl;
+  return 0;
+}
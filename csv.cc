@@ -0,0 +1,117 @@
+#include "csv.h"
+#include "sexp.h"
+#include <cctype>
+#include <charconv>
+#include <cstring>
+
+CsvReader::CsvReader(InPort &port, char delim)
+    : port(port), delim(delim), rows(0), ahead(false), blanks(0) {}
+
+bool CsvReader::next_line() {
+  if (!port.read_line(line)) {
+    return false;
+  }
+  // strip the carriage return of files with windows line endings
+  if (!line.empty() && line.back() == '\r') {
+    line.pop_back();
+  }
+  return true;
+}
+
+// Blank lines at the end of the file aren't rows, so a file ending in a
+// blank line, as most editors leave it, doesn't end in a row with one empty
+// field. Anywhere else they are, which is only known once a line which
+// isn't blank follows them, so that line is read ahead
+bool CsvReader::next_row() {
+  if (!ahead) {
+    if (!next_line()) {
+      return false;
+    }
+    while (line.empty()) {
+      ++blanks;
+      if (!next_line()) {
+        blanks = 0;
+        return false;
+      }
+    }
+    ahead = true;
+  }
+  ++rows;
+  chars.clear();
+  ends.clear();
+  if (blanks > 0) {
+    --blanks;
+    ends.push_back(0);
+    return true;
+  }
+  ahead = false;
+  std::size_t pos = 0;
+  for (;;) {
+    if (pos < line.size() && line[pos] == '\"') {
+      quoted_field(pos);
+    } else {
+      auto start = line.data() + pos;
+      auto next = static_cast<const char *>(
+          std::memchr(start, delim, line.size() - pos));
+      std::size_t length = next ? next - start : line.size() - pos;
+      chars.append(start, length);
+      pos += length;
+    }
+    ends.push_back(chars.size());
+    if (pos >= line.size()) {
+      return true;
+    }
+    // skip the delimiter
+    ++pos;
+  }
+}
+
+// read the quoted field starting at pos, leaving pos after the closing
+// quote. A field can run over several lines
+void CsvReader::quoted_field(std::size_t &pos) {
+  ++pos;
+  for (;;) {
+    auto start = line.data() + pos;
+    auto quote = static_cast<const char *>(
+        std::memchr(start, '\"', line.size() - pos));
+    if (!quote) {
+      // the field carries on onto the next line
+      chars.append(start, line.size() - pos);
+      chars.push_back('\n');
+      if (!next_line()) {
+        throw parser_error("Reached end of file in quoted field of csv row " +
+                           std::to_string(rows));
+      }
+      pos = 0;
+      continue;
+    }
+    chars.append(start, quote - start);
+    pos = quote - line.data() + 1;
+    if (pos < line.size() && line[pos] == '\"') {
+      // "" is an escaped quote
+      chars.push_back('\"');
+      ++pos;
+      continue;
+    }
+    if (pos < line.size() && line[pos] != delim) {
+      throw parser_error("Unexpected character after quoted field in csv row " +
+                         std::to_string(rows));
+    }
+    return;
+  }
+}
+
+// from_chars would also accept inf and nan, which in a csv file are much
+// more likely to be words than numbers
+bool parse_number(std::string_view text, double &result) {
+  if (text.empty() || !(std::isdigit(static_cast<unsigned char>(text[0])) ||
+                        text[0] == '-' || text[0] == '.')) {
+    return false;
+  }
+  if (text.find_first_of("0123456789") == std::string_view::npos) {
+    return false;
+  }
+  auto end = text.data() + text.size();
+  auto converted = std::from_chars(text.data(), end, result);
+  return converted.ptr == end && converted.ec == std::errc();
+}
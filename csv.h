@@ -0,0 +1,57 @@
+#ifndef CSV_H
+#define CSV_H
+
+#include "lisp_exceptions.h"
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class InPort;
+
+/*
+A CsvReader splits the lines of an input port into comma separated fields.
+Each line is taken straight from the port's buffer, and split by searching
+for the next delimiter or quote with memchr. Fields may be quoted with ",
+in which case they can contain delimiters, newlines, and quotes written
+twice (""), as in RFC 4180. A blank line is a row with a single empty
+field, except at the end of the file, where editors usually leave one.
+
+The fields of a row are stored end to end in one string, so reading a row
+doesn't allocate once the reader has seen a row as long.
+*/
+
+class CsvReader {
+private:
+  InPort &port;
+  char delim;
+  std::string line;
+  std::string chars;              // the fields of the current row
+  std::vector<std::size_t> ends;  // where each field ends in chars
+  std::size_t rows;               // the number of rows read so far
+  // whether line has been read ahead, and how many blank rows come first
+  bool ahead;
+  std::size_t blanks;
+
+  bool next_line();
+  void quoted_field(std::size_t &pos);
+
+public:
+  CsvReader(InPort &port, char delim = ',');
+  // read the next row, returning false if there are no more
+  bool next_row();
+  std::size_t size() const { return ends.size(); }
+  // the i'th field of the current row, valid until the next row is read
+  std::string_view field(std::size_t i) const {
+    std::size_t start = i == 0 ? 0 : ends[i - 1];
+    return std::string_view(chars).substr(start, ends[i] - start);
+  }
+  // the number of the current row, counting from 1
+  std::size_t row() const { return rows; }
+};
+
+// convert text to a number if the whole of it is one, returning whether it
+// was
+bool parse_number(std::string_view text, double &result);
+
+#endif
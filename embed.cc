@@ -0,0 +1,237 @@
+#include "lisp.h"
+#include "env.h"
+#include "parser.h"
+#include "sexp.h"
+#include <optional>
+#include <sstream>
+
+using namespace lisp;
+
+bool Value::is_number() const { return dynamic_cast<Number *>(exp); }
+bool Value::is_string() const { return dynamic_cast<String *>(exp); }
+bool Value::is_boolean() const { return dynamic_cast<Bool *>(exp); }
+bool Value::is_list() const { return dynamic_cast<List *>(exp); }
+bool Value::is_function() const { return dynamic_cast<Function *>(exp); }
+
+double Value::number() const {
+  Number *n = dynamic_cast<Number *>(exp);
+  if (!n) {
+    throw evaluation_error("Expected a number, found " + repr());
+  }
+  return n->val();
+}
+
+std::string Value::string() const {
+  String *s = dynamic_cast<String *>(exp);
+  if (!s) {
+    throw evaluation_error("Expected a string, found " + repr());
+  }
+  return std::string(s->val());
+}
+
+bool Value::boolean() const {
+  Bool *b = dynamic_cast<Bool *>(exp);
+  if (!b) {
+    throw evaluation_error("Expected a boolean, found " + repr());
+  }
+  return b->val();
+}
+
+std::vector<Value> Value::elements() const {
+  List *l = dynamic_cast<List *>(exp);
+  if (!l) {
+    throw evaluation_error("Expected a list, found " + repr());
+  }
+  std::vector<Value> elems;
+  elems.reserve(l->elems.size());
+  for (auto it = l->elems.begin(); it != l->elems.end(); ++it) {
+    elems.push_back(Value(*it));
+  }
+  return elems;
+}
+
+bool Value::truthy() const { return is_true(exp); }
+
+std::string Value::repr() const {
+  if (!exp) {
+    return "#<no value>";
+  }
+  std::ostringstream out;
+  out << *exp;
+  return out.str();
+}
+
+Value Context::number(double x) { return Value(env->manage(new Number(x))); }
+
+Value Context::string(const std::string &str) {
+  return Value(env->manage(new String(str)));
+}
+
+Value Context::boolean(bool b) { return Value(env->manage(new Bool(b))); }
+
+Value Context::list(const std::vector<Value> &elems) {
+  std::list<SExp *> l;
+  for (auto it = elems.begin(); it != elems.end(); ++it) {
+    l.push_back(it->sexp());
+  }
+  return Value(env->manage(new List(std::move(l))));
+}
+
+// evals and calls in progress on this thread, more than one when a native
+// function calls back into lisp. Collecting is only safe when there are none
+static thread_local unsigned evaluating = 0;
+
+namespace {
+// counts an eval or call as in progress while it is on the stack
+class Nested {
+public:
+  Nested() { ++evaluating; }
+  ~Nested() { --evaluating; }
+  Nested(const Nested &) = delete;
+  Nested &operator=(const Nested &) = delete;
+};
+
+// the scope a native function is called from
+class CallContext : public Context {
+public:
+  explicit CallContext(Env &env) : Context(&env) {}
+};
+} // namespace
+
+// calls with a few arguments, which are most of them, pass them from the
+// stack
+static const std::size_t stack_args = 8;
+
+Value Context::apply(Value fn, const Value *args, std::size_t count) {
+  Function *func = dynamic_cast<Function *>(fn.sexp());
+  if (!func) {
+    throw evaluation_error("Expected a function, found " + fn.repr());
+  }
+  SExp *on_stack[stack_args];
+  std::vector<SExp *> on_heap;
+  SExp **exps = on_stack;
+  if (count > stack_args) {
+    on_heap.resize(count);
+    exps = on_heap.data();
+  }
+  for (std::size_t i = 0; i < count; ++i) {
+    exps[i] = args[i].sexp();
+  }
+  // a call from a native function is already counted by whatever called it
+  std::optional<Budget> budget;
+  if (!Budget::active() && limits.any()) {
+    budget.emplace(limits);
+  }
+  if (Budget *active = Budget::active()) {
+    active->step();
+  }
+  Nested nested;
+  return Value(func->apply(exps, count, *env));
+}
+
+Interpreter::Interpreter(std::ostream &console)
+    : Context(nullptr), global(new GlobalEnv(console)) {
+  env = global.get();
+}
+
+Interpreter::~Interpreter() {}
+
+// the parsed forms go in the code arena, which lasts as long as the
+// interpreter
+Program Interpreter::compile(const std::string &source) {
+  Program program;
+  auto psr = Parser(source.data(), source.data() + source.size());
+  for (SExp *exp = psr.read_sexp(*global); exp; exp = psr.read_sexp(*global)) {
+    program.forms.push_back(exp);
+  }
+  return program;
+}
+
+// The value of one form is garbage once the next has started, so it's safe
+// to collect between them, as long as the forms themselves are code, which
+// the collector leaves alone. It isn't safe in an eval from a native
+// function, part way through evaluating something else
+Value Interpreter::run(const std::vector<SExp *> &forms, bool collect) {
+  std::optional<Budget> budget;
+  if (!Budget::active() && limits.any()) {
+    budget.emplace(limits);
+  }
+  Nested nested;
+  SExp *result = nullptr;
+  for (auto it = forms.begin(); it != forms.end(); ++it) {
+    if (result && collect && evaluating == 1) {
+      global->maybe_collect_garbage();
+    }
+    result = (*it)->eval(*global);
+  }
+  return Value(result);
+}
+
+Value Interpreter::eval(const Program &program) {
+  return run(program.forms, true);
+}
+
+// Source which is only run once is parsed into the heap, like data read at
+// runtime, so that it's freed once nothing refers to it: a lambda it
+// defines keeps its body. Nothing refers to the forms before they're
+// evaluated, so nothing is collected until they all have been
+Value Interpreter::eval(const std::string &source) {
+  std::vector<SExp *> forms;
+  auto psr =
+      Parser(source.data(), source.data() + source.size(), ParseMode::data);
+  for (SExp *exp = psr.read_sexp(*global); exp; exp = psr.read_sexp(*global)) {
+    forms.push_back(exp);
+  }
+  return run(forms, false);
+}
+
+Value Interpreter::lookup(const std::string &name) {
+  SExp *value = global->lookup(name);
+  if (!value) {
+    throw evaluation_error("Encountered undefined atom " + name);
+  }
+  return Value(value);
+}
+
+void Interpreter::define(const std::string &name, Value value) {
+  global->def(name, value.sexp());
+}
+
+// the native function is wrapped in a builtin, which evaluates its
+// arguments and hands them over as values
+void Interpreter::define(const std::string &name, NativeFunction fn) {
+  auto builtin = [fn, name](std::list<SExp *> &args, Env &env) -> SExp * {
+    Value on_stack[stack_args];
+    std::vector<Value> on_heap;
+    Value *values = on_stack;
+    if (args.size() > stack_args) {
+      on_heap.resize(args.size());
+      values = on_heap.data();
+    }
+    std::size_t count = 0;
+    for (auto it = args.begin(); it != args.end(); ++it) {
+      values[count++] = Value((*it)->eval(env));
+    }
+    CallContext context(env);
+    SExp *result = fn(context, values, count).sexp();
+    if (!result) {
+      throw evaluation_error("Native function " + name + " returned nothing");
+    }
+    return result;
+  };
+  global->def(name, global->manage(new PrimitiveFunction(builtin, name)));
+}
+
+void Interpreter::set_max_heap(std::size_t bytes) {
+  global->set_max_heap(bytes);
+}
+
+void Interpreter::set_gc_threads(unsigned n) { global->set_gc_threads(n); }
+
+void Interpreter::set_workers(unsigned n) { global->set_workers(n); }
+
+void Interpreter::collect_garbage() {
+  if (evaluating == 0) {
+    global->collect_garbage();
+  }
+}
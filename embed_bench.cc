@@ -0,0 +1,85 @@
+/*
+Measures the cost of calling into lisp from C++ through the embedding
+interface (see lisp.h), compared with evaluating source text for each call,
+and of calling a native function from lisp.
+  make embed_bench && ./embed_bench [calls]
+*/
+#include "lisp.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+// microseconds per call of f, run count times
+template <typename F> double time_calls(long count, F f) {
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < count; ++i) {
+    f(i);
+  }
+  std::chrono::duration<double, std::micro> taken =
+      std::chrono::steady_clock::now() - start;
+  return taken.count() / count;
+}
+
+int main(int argc, char *argv[]) {
+  long count = argc > 1 ? std::strtol(argv[1], nullptr, 10) : 100000;
+  lisp::Interpreter lisp;
+  lisp.set_gc_threads(1);
+  lisp.define("native-add",
+              [](lisp::Context &cx, const lisp::Value *args, std::size_t n) {
+                return cx.number(args[0].number() + args[1].number());
+              });
+  lisp.eval("(define add (lambda (x y) (+ x y)))"
+            "(define call-native (lambda (x) (native-add x 1)))");
+  lisp::Value add = lisp.lookup("add");
+  lisp::Program program = lisp.compile("(add 1 2)");
+
+  double total = 0;
+  double call = time_calls(count, [&](long i) {
+    total += lisp.call(add, double(i), 2.0).number();
+    if (i % 1000 == 0) {
+      lisp.collect_garbage();
+    }
+  });
+  double by_name = time_calls(count, [&](long i) {
+    total += lisp.call("add", double(i), 2.0).number();
+    if (i % 1000 == 0) {
+      lisp.collect_garbage();
+    }
+  });
+  double compiled = time_calls(count, [&](long i) {
+    total += lisp.eval(program).number();
+    if (i % 1000 == 0) {
+      lisp.collect_garbage();
+    }
+  });
+  double parsed = time_calls(count, [&](long i) {
+    total += lisp.eval("(add " + std::to_string(i) + " 2)").number();
+    if (i % 1000 == 0) {
+      lisp.collect_garbage();
+    }
+  });
+  lisp::Value native_add = lisp.lookup("native-add");
+  double to_native = time_calls(count, [&](long i) {
+    total += lisp.call(native_add, double(i), 2.0).number();
+    if (i % 1000 == 0) {
+      lisp.collect_garbage();
+    }
+  });
+  double native = time_calls(count, [&](long i) {
+    total += lisp.call("call-native", double(i)).number();
+    if (i % 1000 == 0) {
+      lisp.collect_garbage();
+    }
+  });
+
+  std::cout << "microseconds per call, over " << count << " calls\n"
+            << "  call with a looked up function: " << call << "\n"
+            << "  call by name:                   " << by_name << "\n"
+            << "  eval of a compiled program:     " << compiled << "\n"
+            << "  eval of source text:            " << parsed << "\n"
+            << "  call of a native function:      " << to_native << "\n"
+            << "  lisp calling a native function: " << native << "\n"
+            << "(checksum " << total << ")" << std::endl;
+  return 0;
+}
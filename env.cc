@@ -1,5 +1,10 @@
 
+#include "budget.h"
+#include "coroutine.h"
 #include "env.h"
+#include "future.h"
+#include "iobuf.h"
+#include "pool.h"
 #include "primitives.h"
 #include "sexp.h"
 
@@ -48,7 +53,26 @@ SExp *GlobalEnv::mk_builtin(std::function<SExp *(std::list<SExp *>, Env &)> fn,
 }
 
 // called to create a blank environment: bind the language builtins
-GlobalEnv::GlobalEnv() { bind_primitives(); }
+GlobalEnv::GlobalEnv(std::ostream &console)
+    : console(console), workers(std::thread::hardware_concurrency()),
+      console_lock(std::make_shared<PortLock>()),
+      console_in(std::make_shared<InputBuffer>(0, false)),
+      console_in_lock(std::make_shared<PortLock>()), base(nullptr),
+      layer(nullptr) {
+  set_workers(workers);
+  bind_primitives();
+}
+
+GlobalEnv::GlobalEnv(GlobalEnv *parent)
+    : console(parent->console), workers(parent->workers),
+      console_lock(parent->console_lock), console_in(parent->console_in),
+      console_in_lock(parent->console_in_lock), base(nullptr), layer(nullptr) {
+  heap.set_hash_consing(parent->heap.hash_consing());
+  heap.set_collector(parent->heap.get_collector());
+  heap.set_gc_threads(parent->heap.get_gc_threads());
+  heap.set_max_heap(parent->heap.get_max_heap());
+  bind_primitives();
+}
 
 SExp *Env::lookup(std::string id) {
 
@@ -94,8 +118,11 @@ void GlobalEnv::bind_primitives() {
   def("display", mk_builtin(display, "display"));
   def("displayln", mk_builtin(displayln, "displayln"));
   def("close-output-port", mk_builtin(close_output_port, "close-output-port"));
+  def("flush-output", mk_builtin(flush_output, "flush-output"));
   // bind standard output and input to lisp input and output objects
-  def("std-output-port", heap.manage(new OutPort()));
+  def("std-output-port", heap.manage(new OutPort(console, console_lock)));
+  def("std-input-port",
+      heap.manage(new InPort(console_in, console_in_lock)));
   def("%", mk_builtin(modulo, "%"));
   def("not", mk_builtin(not_stmt, "not"));
   def("map", mk_builtin(map, "map"));
@@ -107,7 +134,52 @@ void GlobalEnv::bind_primitives() {
   def("open-input-port", mk_builtin(open_input_port, "open-input-port"));
   def("close-input-port", mk_builtin(close_input_port, "close-input-port"));
   def("port->string", mk_builtin(port_to_string, "port->string"));
+  def("open-output-string",
+      mk_builtin(open_output_string, "open-output-string"));
+  def("get-output-string", mk_builtin(get_output_string, "get-output-string"));
+  def("open-input-string", mk_builtin(open_input_string, "open-input-string"));
+  def("read-line", mk_builtin(read_line, "read-line"));
+  def("for-each-line", mk_builtin(for_each_line, "for-each-line"));
   def("read", mk_builtin(read, "read"));
+  def("eof", heap.manage(new Eof()));
+  def("eof-object?", mk_builtin(is_eof, "eof-object?"));
+  def("string-length", mk_builtin(string_length, "string-length"));
+  def("substring", mk_builtin(substring, "substring"));
+  def("make-bytevector", mk_builtin(make_bytevector, "make-bytevector"));
+  def("bytevector?", mk_builtin(is_bytevector, "bytevector?"));
+  def("bytevector-length", mk_builtin(bytevector_length, "bytevector-length"));
+  def("bytevector-u8-ref", mk_builtin(bytevector_u8_ref, "bytevector-u8-ref"));
+  def("bytevector-u8-set!",
+      mk_builtin(bytevector_u8_set, "bytevector-u8-set!"));
+  def("read-bytes", mk_builtin(read_bytes, "read-bytes"));
+  def("read-bytes-at", mk_builtin(read_bytes_at, "read-bytes-at"));
+  def("write-bytes", mk_builtin(write_bytes, "write-bytes"));
+  def("file-size", mk_builtin(primitive::file_size, "file-size"));
+  def("read-csv", mk_builtin(read_csv, "read-csv"));
+  def("vector?", mk_builtin(is_vector, "vector?"));
+  def("vector-length", mk_builtin(vector_length, "vector-length"));
+  def("vector-ref", mk_builtin(vector_ref, "vector-ref"));
+  def("vector->list", mk_builtin(vector_to_list, "vector->list"));
+  def("pmap", mk_builtin(pmap, "pmap"));
+  def("pfilter", mk_builtin(pfilter, "pfilter"));
+  def("preduce", mk_builtin(preduce, "preduce"));
+  def("spawn", mk_builtin(spawn, "spawn"));
+  def("touch", mk_builtin(touch, "touch"));
+  def("await", mk_builtin(touch, "await"));
+  def("make-channel", mk_builtin(make_channel, "make-channel"));
+  def("channel-put", mk_builtin(channel_put, "channel-put"));
+  def("channel-get", mk_builtin(channel_get, "channel-get"));
+  def("make-coroutine", mk_builtin(make_coroutine, "make-coroutine"));
+  def("resume", mk_builtin(resume, "resume"));
+  def("yield", mk_builtin(yield, "yield"));
+  def("coroutine-done?", mk_builtin(coroutine_done, "coroutine-done?"));
+  def("run-coroutines", mk_builtin(run_coroutines, "run-coroutines"));
+  def("schedule", mk_builtin(schedule, "schedule"));
+  def("make-pipe", mk_builtin(make_pipe, "make-pipe"));
+  def("make-socket-pair", mk_builtin(make_socket_pair, "make-socket-pair"));
+  def("connect-socket",
+      mk_builtin(primitive::connect_socket, "connect-socket"));
+  def("input-ready?", mk_builtin(input_ready, "input-ready?"));
   return;
 }
 
@@ -120,7 +192,122 @@ void GlobalEnv::bind_argv(int argc, char *argv[]) {
   def("ARGV", heap.manage(new List(arglist)));
 }
 
-GlobalEnv::~GlobalEnv() {}
+// wait for any interpreters this one started, since they may still be
+// writing to its console
+GlobalEnv::~GlobalEnv() {
+  std::lock_guard<std::mutex> guard(spawned_lock);
+  for (auto it = spawned.begin(); it != spawned.end(); ++it) {
+    (*it)->join();
+  }
+  if (base) {
+    base->layer = nullptr;
+  }
+}
+
+void GlobalEnv::join_threads() {
+  std::lock_guard<std::mutex> guard(spawned_lock);
+  for (auto it = spawned.begin(); it != spawned.end(); ++it) {
+    (*it)->join();
+  }
+  heap.finish_sweep();
+}
+
+SExp *GlobalEnv::import(SExp *value, GlobalEnv &from) {
+  return heap.import(std::vector<SExp *>{value}, from, *this).front();
+}
+
+// everything is copied in one go, so that values the definitions share
+// are only copied once. The definitions of a layered interpreter include
+// those it falls back on
+SExp *GlobalEnv::import_globals(SExp *value, GlobalEnv &from) {
+  std::unordered_map<std::string, SExp *> globals;
+  for (GlobalEnv *g = &from; g; g = g->base) {
+    globals.insert(g->scope.begin(), g->scope.end());
+  }
+  std::vector<std::string> names;
+  std::vector<SExp *> values{value};
+  for (auto it = globals.begin(); it != globals.end(); ++it) {
+    names.push_back(it->first);
+    values.push_back(it->second);
+  }
+  std::vector<SExp *> copies = heap.import(values, from, *this);
+  for (std::size_t i = 0; i < names.size(); ++i) {
+    def(names[i], copies[i + 1]);
+  }
+  return copies.front();
+}
+
+// finished interpreters are forgotten as others are started, so a program
+// which spawns a lot doesn't hold on to them all
+void GlobalEnv::add_spawned(std::shared_ptr<FutureState> future) {
+  std::lock_guard<std::mutex> guard(spawned_lock);
+  spawned.erase(std::remove_if(spawned.begin(), spawned.end(),
+                               [](std::shared_ptr<FutureState> &f) {
+                                 return f->finished_running();
+                               }),
+                spawned.end());
+  spawned.push_back(std::move(future));
+}
+
+void GlobalEnv::coroutine_started(CoroutineState *co) {
+  std::lock_guard<std::mutex> guard(coroutines_lock);
+  suspended_coroutines.insert(co);
+}
+
+void GlobalEnv::coroutine_finished(CoroutineState *co) {
+  std::lock_guard<std::mutex> guard(coroutines_lock);
+  suspended_coroutines.erase(co);
+}
+
+// A suspended coroutine only runs again when something resumes it, so once
+// one can't be reached from the globals it never will, and it is finished
+// off, unwinding its stack. Those which can be reached keep what their
+// stacks are using alive, but the stacks have the addresses of objects
+bool GlobalEnv::release_coroutines() {
+  std::vector<CoroutineState *> suspended;
+  {
+    std::lock_guard<std::mutex> guard(coroutines_lock);
+    if (suspended_coroutines.empty()) {
+      return true;
+    }
+    suspended.assign(suspended_coroutines.begin(), suspended_coroutines.end());
+  }
+  std::vector<SExp *> roots;
+  for (GlobalEnv *g = this; g; g = g->base) {
+    for (auto it = g->scope.begin(); it != g->scope.end(); ++it) {
+      roots.push_back(it->second);
+    }
+  }
+  auto reached = heap.reachable_coroutines(roots);
+  for (auto it = suspended.begin(); it != suspended.end(); ++it) {
+    if (!reached.count(*it)) {
+      (*it)->cancel();
+    }
+  }
+  std::lock_guard<std::mutex> guard(coroutines_lock);
+  return suspended_coroutines.empty();
+}
+
+// hash consing only works within one heap, so a layer doesn't: values it
+// makes can't be found in the table of its base's canonical values
+GlobalEnv::GlobalEnv(GlobalEnv &under, std::ostream &console)
+    : Env(&under), console(console), workers(under.workers),
+      console_lock(std::make_shared<PortLock>()),
+      console_in(std::make_shared<InputBuffer>(nullptr, nullptr)),
+      console_in_lock(std::make_shared<PortLock>()), base(&under),
+      layer(nullptr) {
+  if (under.layer) {
+    throw implementation_error("Interpreter already has a layer over it");
+  }
+  heap.set_base(&under.heap);
+  heap.set_collector(under.heap.get_collector());
+  heap.set_gc_threads(under.heap.get_gc_threads());
+  heap.set_max_heap(under.heap.get_max_heap());
+  def("std-output-port", heap.manage(new OutPort(console, console_lock)));
+  def("std-input-port",
+      heap.manage(new InPort(console_in, console_in_lock)));
+  under.layer = this;
+}
 
 Env GlobalEnv::capture_scope() {
   // create a new Env, closing over the current scope.
@@ -145,3 +332,68 @@ SExp *Env::manage(SExp *new_obj) {
   // keep all control of allocation in the global scope
   return global->manage(new_obj);
 }
+
+void Env::reserve(std::size_t bytes) { global->reserve(bytes); }
+
+CodeArena &Env::code() { return global->code(); }
+
+bool Env::hash_consing() { return global->hash_consing(); }
+
+GlobalEnv &Env::get_global() { return global->get_global(); }
+
+void Env::parallel_for(std::size_t count,
+                       const std::function<void(std::size_t)> &task) {
+  global->parallel_for(count, task);
+}
+
+// Each thread allocates into its own batch, and the batches are added to
+// the heap afterwards, even if a task failed, so that whatever they
+// allocated is still collected. Values made on other threads can't be
+// looked up in the table of canonical values, so the work is done serially
+// when hash consing
+void GlobalEnv::parallel_for(std::size_t count,
+                             const std::function<void(std::size_t)> &task) {
+  if (layer) {
+    layer->parallel_for(count, task);
+    return;
+  }
+  unsigned threads = heap.hash_consing() ? 1 : workers;
+  if (threads == 1 || WorkPool::on_worker()) {
+    for (std::size_t i = 0; i < count; ++i) {
+      task(i);
+    }
+    return;
+  }
+  std::vector<Heap::Batch> batches(threads, Heap::Batch{&heap});
+  auto merge = [this, &batches]() {
+    Heap::use_batch(nullptr);
+    for (auto it = batches.begin(); it != batches.end(); ++it) {
+      heap.merge(*it);
+    }
+  };
+  // the tasks share what's left of the budget, and what they used is
+  // charged to it once they have all finished
+  Budget *budget = Budget::active();
+  Limits left = budget ? budget->remaining() : Limits();
+  SharedCounts used;
+  try {
+    WorkPool(threads).run(count, [&task, &batches, &left, &used](
+                                     std::size_t i, unsigned worker) {
+      Heap::use_batch(&batches[worker]);
+      if (!left.any()) {
+        task(i);
+        return;
+      }
+      Budget share(left, &used);
+      task(i);
+    });
+  } catch (...) {
+    merge();
+    throw;
+  }
+  merge();
+  heap.check_limit();
+  if (budget) {
+    budget->charge(used.steps, used.bytes);
+  }
+}
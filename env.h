@@ -4,10 +4,19 @@
 #include "lisp_exceptions.h"
 //#include "sexp.h"
 #include <functional>
+#include <iostream>
 #include <list>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
+class FutureState;
+class CoroutineState;
+class PortLock;
+class InputBuffer;
+
 /*
 The Env manages scope resolution and definition via a symbol table. This
 functionality is essentially a wrapper around a hash table mapping strings to
@@ -19,10 +28,15 @@ class Env {
 private:
 
   GlobalEnv *const global;
+  // a scope with the given bindings which falls back on g's
+  Env(GlobalEnv &g, std::unordered_map<std::string, SExp *> scope)
+      : global(&g), scope(std::move(scope)) {}
 
 protected:
   std::unordered_map<std::string, SExp *> scope;
   Env() : global(nullptr) {}
+  // an empty scope which falls back on fallback's
+  explicit Env(GlobalEnv *fallback) : global(fallback) {}
 
 public:
   //return a copy of the current symbol table
@@ -32,6 +46,19 @@ public:
   }
   //Manage a new object with the garbage collector.
   virtual SExp *manage(SExp *obj);
+  //throw if an object of bytes wouldn't fit in the heap or the budget, before
+  //allocating it
+  virtual void reserve(std::size_t bytes);
+  //The arena which holds parsed program text
+  virtual CodeArena &code();
+  //true if equal immutable values are shared (see heap.h)
+  virtual bool hash_consing();
+  //the interpreter this scope belongs to
+  virtual GlobalEnv &get_global();
+  //call task(i) for every i in [0, count), on several threads if possible.
+  //The tasks must not change anything they share
+  virtual void parallel_for(std::size_t count,
+                            const std::function<void(std::size_t)> &task);
   
   //look up an identifier in the symbol table
   SExp *lookup(std::string id);
@@ -40,24 +67,91 @@ public:
 
   Env(GlobalEnv &g);
   virtual ~Env() {}
+  friend class CoroutineState;
   friend class Heap;
+  friend class ImageWriter;
+  friend class ImageReader;
 };
 
 class GlobalEnv : public Env {
 private:
   Heap heap;
+  std::ostream &console; // where standard output goes
+  unsigned workers;      // threads used by the parallel primitives
+  // held while writing to console, by every interpreter which shares it
+  std::shared_ptr<PortLock> console_lock;
+  // where std-input-port and the repl read standard input from, shared with
+  // spawned interpreters along with its lock
+  std::shared_ptr<InputBuffer> console_in;
+  std::shared_ptr<PortLock> console_in_lock;
+  // interpreters started by spawn, which must finish before this one
+  std::vector<std::shared_ptr<FutureState>> spawned;
+  std::mutex spawned_lock; // spawn can be called from pmap's workers
+  // coroutines which have started but not returned (see coroutine.h). They
+  // can be started and finished by pmap's workers
+  std::unordered_set<CoroutineState *> suspended_coroutines;
+  std::mutex coroutines_lock;
+  GlobalEnv *base;  // the interpreter this one is layered over, if any
+  GlobalEnv *layer; // the interpreter layered over this one, if any
   //helper functions for creating builtins.
   SExp *mk_numeric_primitive(std::function<double(double acc, double x)> func,
                              std::string funcname);
 
   SExp *mk_builtin(std::function<SExp *(std::list<SExp *>, Env &)>,
                    std::string name);
+  // finish off the suspended coroutines nothing can resume, and return
+  // whether there are none left, so objects can be moved
+  bool release_coroutines();
 
 public:
-
-  GlobalEnv();
+  // Each GlobalEnv is a separate interpreter, sharing nothing with any
+  // other, so different ones can be used on different threads at once.
+  // Output to std-output-port goes to console
+  GlobalEnv(std::ostream &console = std::cout);
+  // A new interpreter for another thread, with the same console and heap
+  // settings as parent. It shares nothing with parent, though values can be
+  // copied from one to the other with import
+  explicit GlobalEnv(GlobalEnv *parent);
+  // A new interpreter layered over under, for running a program on top of
+  // definitions under has already made. It looks up whatever it doesn't
+  // define itself in under, and has its own heap, which can refer to
+  // under's. While it exists, under mustn't be used for anything else:
+  // functions defined in under allocate in the layer, and see it as their
+  // interpreter, so that nothing in under ever changes or refers to the
+  // layer. It has standard output of its own, and no standard input
+  GlobalEnv(GlobalEnv &under, std::ostream &console);
   Env capture_scope() override;
-  SExp *manage(SExp *obj) override { return heap.manage(obj); }
+  SExp *manage(SExp *obj) override {
+    return layer ? layer->manage(obj) : heap.manage(obj);
+  }
+  void reserve(std::size_t bytes) override {
+    layer ? layer->reserve(bytes) : heap.reserve(bytes);
+  }
+  CodeArena &code() override {
+    return layer ? layer->code() : heap.code_arena();
+  }
+  bool hash_consing() override {
+    return layer ? layer->hash_consing() : heap.hash_consing();
+  }
+  GlobalEnv &get_global() override {
+    return layer ? layer->get_global() : *this;
+  }
+  // the interpreter this one is layered over, if any
+  GlobalEnv *get_base() { return base; }
+  // the buffer std-input-port reads standard input through, for the repl to
+  // read through as well, so that neither reads ahead of the other. Whatever
+  // reads from it should hold console_input_lock() meanwhile
+  InputBuffer &console_input() { return *console_in; }
+  PortLock &console_input_lock() { return *console_in_lock; }
+  // copy value, and everything it refers to, from another interpreter
+  SExp *import(SExp *value, GlobalEnv &from);
+  // copy every global definition in from into this interpreter, along with
+  // value, returning the copy of value
+  SExp *import_globals(SExp *value, GlobalEnv &from);
+  // keep track of an interpreter started from this one
+  void add_spawned(std::shared_ptr<FutureState> future);
+  void parallel_for(std::size_t count,
+                    const std::function<void(std::size_t)> &task) override;
   
   //bind the language builtin functions to the symbol table
   void bind_primitives();
@@ -74,7 +168,23 @@ public:
   GlobalEnv(const GlobalEnv &) = delete;
   GlobalEnv &operator=(const GlobalEnv &) = delete;
   //run the garbage collector
-  void collect_garbage() { heap.collect_garbage(*this); }
+  void collect_garbage() { heap.collect_garbage(*this, release_coroutines()); }
+  //run the garbage collector if enough has been allocated since it last ran.
+  //Only call this between top level forms
+  void maybe_collect_garbage() {
+    if (heap.wants_collection())
+      collect_garbage();
+  }
+  // wait for everything this interpreter has running on other threads, so
+  // the process can be forked
+  void join_threads();
+  void coroutine_started(CoroutineState *co);
+  void coroutine_finished(CoroutineState *co);
+  void set_max_heap(std::size_t bytes) { heap.set_max_heap(bytes); }
+  void set_hash_consing(bool on) { heap.set_hash_consing(on); }
+  void set_gc_threads(unsigned n) { heap.set_gc_threads(n); }
+  void set_collector(Collector c) { heap.set_collector(c); }
+  void set_workers(unsigned n) { workers = n > 0 ? n : 1; }
 };
 
 #endif
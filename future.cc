@@ -0,0 +1,119 @@
+#include "coroutine.h"
+#include "future.h"
+#include "sexp.h"
+#include <cstring>
+#include <sys/resource.h>
+
+// Programs loop by recursing, so a spawned interpreter needs as much stack
+// as the main thread gets, rather than the default for a new thread
+static std::size_t stack_size() {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_STACK, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) {
+    return std::size_t(1) << 28;
+  }
+  return limit.rlim_cur;
+}
+
+// the global definitions are copied before the thread starts, while the
+// parent is still the only thread using its heap
+FutureState::FutureState(GlobalEnv &parent, SExp *thunk)
+    : env(&parent), joinable(false), done(false), result(nullptr) {
+  this->thunk = env.import_globals(thunk, parent);
+  if (Budget *budget = Budget::active()) {
+    limits = budget->remaining();
+  }
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, stack_size());
+  int err = pthread_create(&thread, &attr, &FutureState::run, this);
+  pthread_attr_destroy(&attr);
+  if (err != 0) {
+    throw evaluation_error("Couldn't start a thread for spawn: " +
+                           std::string(std::strerror(err)));
+  }
+  joinable = true;
+}
+
+void *FutureState::run(void *arg) {
+  FutureState *state = static_cast<FutureState *>(arg);
+  SExp *value = nullptr;
+  std::exception_ptr raised;
+  try {
+    std::unique_ptr<Budget> budget;
+    if (state->limits.any()) {
+      budget.reset(new Budget(state->limits));
+    }
+    Function *fn = dynamic_cast<Function *>(state->thunk);
+    if (!fn) {
+      throw evaluation_error("Cannot spawn a non-function");
+    }
+    value = fn->call(std::list<SExp *>(), state->env);
+  } catch (...) {
+    // including exit, which ends the interpreter that touches the future
+    raised = std::current_exception();
+  }
+  std::lock_guard<std::mutex> guard(state->lock);
+  state->result = value;
+  state->error = raised;
+  state->done = true;
+  state->finished.notify_all();
+  return nullptr;
+}
+
+SExp *FutureState::touch(GlobalEnv &to) {
+  std::unique_lock<std::mutex> guard(lock);
+  finished.wait(guard, [this] { return done; });
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  return to.import(result, env);
+}
+
+bool FutureState::finished_running() {
+  std::lock_guard<std::mutex> guard(lock);
+  return done;
+}
+
+void FutureState::join() {
+  if (joinable) {
+    pthread_join(thread, nullptr);
+    joinable = false;
+  }
+}
+
+// the channel's heap only ever holds the values waiting in it, so it is kept
+// small and collected serially
+ChannelState::ChannelState(std::size_t capacity) : capacity(capacity) {
+  holder.set_gc_threads(1);
+}
+
+void ChannelState::put(SExp *value, GlobalEnv &from) {
+  std::unique_lock<std::mutex> guard(lock);
+  if (items.size() >= capacity && Scheduler::running_scheduled()) {
+    throw evaluation_error(
+        "Cannot wait for a full channel in a coroutine run by run-coroutines");
+  }
+  not_full.wait(guard, [this] { return items.size() < capacity; });
+  items.push_back(holder.import(value, from));
+  not_empty.notify_one();
+}
+
+SExp *ChannelState::get(GlobalEnv &to) {
+  std::unique_lock<std::mutex> guard(lock);
+  if (items.empty() && Scheduler::running_scheduled()) {
+    throw evaluation_error(
+        "Cannot wait for an empty channel in a coroutine run by "
+        "run-coroutines");
+  }
+  not_empty.wait(guard, [this] { return !items.empty(); });
+  SExp *value = to.import(items.front(), holder);
+  items.pop_front();
+  // the values still waiting are the only live data in the holder: bind
+  // them where the collector will find them
+  holder.def("channel-contents",
+             holder.manage(new List(std::list<SExp *>(items.begin(),
+                                                      items.end()))));
+  holder.maybe_collect_garbage();
+  not_full.notify_one();
+  return value;
+}
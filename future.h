@@ -0,0 +1,89 @@
+#ifndef FUTURE_H
+#define FUTURE_H
+
+#include "budget.h"
+#include "env.h"
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+
+/*
+Futures and channels let a program do several things at once, each in an
+interpreter of its own on a thread of its own.
+
+spawn starts a new interpreter, with copies of the global definitions of
+the one that spawned it, and has it call a function of no arguments on a
+new thread. It returns a future, and touching the future waits for the call
+to finish and copies its result back. An interpreter waits for everything
+it spawned to finish before it goes away.
+
+A channel is a bounded queue which any interpreter holding it can put
+values into and take them out of, waiting while it is full or empty.
+
+An interpreter's heap is only ever used by one thread, so interpreters
+never share anything the collector manages: values are copied from one
+heap to another (see Heap::import). A value put in a channel is copied into
+a heap belonging to the channel, and copied again by whoever takes it.
+Futures and channels themselves are handles, so copying one gives a handle
+on the same thread or queue, which is how they are passed to spawned
+functions.
+
+A spawned call's budget (see budget.h) is whatever was left of the budget
+of the thread which spawned it.
+
+Spawned interpreters write to the same console as their parent, and take
+the same lock while they do, so expressions displayed on different threads
+don't get mixed up together. Like any top level form, the call a spawned
+interpreter makes isn't garbage collected until it returns.
+*/
+
+class FutureState {
+private:
+  GlobalEnv env;
+  pthread_t thread;
+  bool joinable;
+  std::mutex lock;
+  std::condition_variable finished;
+  bool done;
+  SExp *result; // in env's heap
+  std::exception_ptr error;
+  SExp *thunk;
+  Limits limits; // what was left of the spawning thread's budget
+  static void *run(void *state);
+
+public:
+  // call thunk, a function from parent, on a new thread
+  FutureState(GlobalEnv &parent, SExp *thunk);
+  // wait for the call to return, then copy its result into to, or throw the
+  // error it raised
+  SExp *touch(GlobalEnv &to);
+  bool finished_running();
+  // wait for the thread to finish
+  void join();
+  ~FutureState() { join(); }
+};
+
+class ChannelState {
+private:
+  std::mutex lock;
+  std::condition_variable not_full;
+  std::condition_variable not_empty;
+  std::size_t capacity;
+  std::deque<SExp *> items; // in holder's heap
+  GlobalEnv holder;
+
+public:
+  ChannelState(std::size_t capacity);
+  // copy value, from the interpreter from, into the channel. These wait
+  // while the channel is full or empty, except in a coroutine a scheduler
+  // is running, which raises an error instead (see coroutine.h)
+  void put(SExp *value, GlobalEnv &from);
+  // take the oldest value from the channel, copied into to
+  SExp *get(GlobalEnv &to);
+};
+
+#endif
@@ -0,0 +1,40 @@
+;;A benchmark for the garbage collector: build a large heap of live data,
+;;then run a lot of small top-level forms, each of which is a point where
+;;the heap may collect. Try it with different collector settings, e.g.
+;;  time ./main --gc-threads 1 gc_bench.lisp
+;;  time ./main --gc-threads 4 gc_bench.lisp
+
+(define ten '(0 1 2 3 4 5 6 7 8 9))
+
+(define hundred
+	(fold (lambda (acc x) (fold (lambda (acc y) (cons (+ (* 10 x) y) acc)) acc ten))
+		'() ten))
+
+;; 100 * 100 * 100 numbers, in 10100 lists
+(define cube
+	(map (lambda (x) (map (lambda (y) (map (lambda (z) (+ x y z)) hundred)) hundred))
+		ten))
+
+(define count 0)
+(define count (+ count 1))
+(define count (+ count 1))
+(define count (+ count 1))
+(define count (+ count 1))
+(define count (+ count 1))
+(define count (+ count 1))
+(define count (+ count 1))
+(define count (+ count 1))
+(define count (+ count 1))
+(define count (+ count 1))
+(define count (+ count 1))
+(define count (+ count 1))
+(define count (+ count 1))
+(define count (+ count 1))
+(define count (+ count 1))
+(define count (+ count 1))
+(define count (+ count 1))
+(define count (+ count 1))
+(define count (+ count 1))
+(define count (+ count 1))
+
+(displayln count)
@@ -1,40 +1,310 @@
+#include "budget.h"
+#include "coroutine.h"
 #include "env.h"
 #include "heap.h"
 #include "sexp.h"
+#include <deque>
+#include <exception>
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <new>
 #include <typeinfo>
 
-Heap::Heap(Heap &&other) { objects = std::move(other.objects); }
+// below this many objects, starting the mark threads costs more than it saves
+static const std::size_t parallel_mark_threshold = 1 << 14;
+// a worker shares half of its private mark stack once it grows past this
+static const std::size_t mark_spill_size = 256;
+
+// the number of bytes an object occupies, not counting anything it owns
+class Heap::ObjectSize : public SExpVisitor {
+public:
+  std::size_t size;
+  std::size_t of(SExp *addr) {
+    addr->exec(*this);
+    return size;
+  }
+  void visit(Number &number) { size = sizeof(Number); }
+  void visit(String &string) { size = sizeof(String); }
+  void visit(Bool &boolean) { size = sizeof(Bool); }
+  void visit(Atom &atom) { size = sizeof(Atom); }
+  void visit(List &list) { size = sizeof(List); }
+  void visit(PrimitiveFunction &fn) { size = sizeof(PrimitiveFunction); }
+  void visit(LambdaFunction &lambda) { size = sizeof(LambdaFunction); }
+  void visit(InPort &in) { size = sizeof(InPort); }
+  void visit(OutPort &out) { size = sizeof(OutPort); }
+  void visit(Eof &eof) { size = sizeof(Eof); }
+  void visit(Bytevector &bytes) { size = sizeof(Bytevector); }
+  void visit(NumberVector &vec) { size = sizeof(NumberVector); }
+  void visit(StringVector &vec) { size = sizeof(StringVector); }
+  void visit(Future &future) { size = sizeof(Future); }
+  void visit(Channel &channel) { size = sizeof(Channel); }
+  void visit(Coroutine &coroutine) { size = sizeof(Coroutine); }
+};
+
+// a rough count of the memory an object is responsible for, including the
+// storage owned by its strings and containers. This only needs to be good
+// enough to decide when to collect
+class Heap::Footprint : public SExpVisitor {
+private:
+  // per element overhead of std::list and std::unordered_map nodes
+  static const std::size_t list_node = 3 * sizeof(void *);
+  static const std::size_t map_node = 4 * sizeof(void *) + sizeof(std::string);
+  ObjectSize object_size;
+
+public:
+  std::size_t size;
+  std::size_t of(SExp *addr) {
+    size = object_size.of(addr);
+    addr->exec(*this);
+    return size;
+  }
+  void visit(Number &number) {}
+  // substrings are counted as though they had their own copy
+  void visit(String &string) { size += string.val().size(); }
+  void visit(Bool &boolean) {}
+  void visit(Atom &atom) { size += atom.get_identifier().capacity(); }
+  void visit(List &list) { size += list.elems.size() * list_node; }
+  void visit(PrimitiveFunction &fn) {}
+  void visit(LambdaFunction &lambda) {
+    size += (lambda.body.size() + lambda.params.size()) * list_node +
+            lambda.closure.scope.size() * map_node;
+  }
+  void visit(InPort &in) {}
+  void visit(OutPort &out) {}
+  void visit(Eof &eof) {}
+  void visit(Bytevector &bytes) { size += bytes.bytes.capacity(); }
+  void visit(NumberVector &vec) {
+    size += vec.values.capacity() * sizeof(double);
+  }
+  void visit(StringVector &vec) {
+    size += vec.chars->capacity() + vec.ends.capacity() * sizeof(std::size_t);
+  }
+  // the interpreters and queues behind these have heaps of their own
+  void visit(Future &future) {}
+  void visit(Channel &channel) {}
+  void visit(Coroutine &coroutine) {}
+};
+
+Heap::Heap()
+    : allocated(0), live_after_gc(0), live_objects(0), max_heap(0),
+      base(nullptr), hash_cons(false), collector(Collector::mark_sweep) {
+  unsigned n = std::thread::hardware_concurrency();
+  set_gc_threads(n);
+  set_next_gc();
+}
+
+Heap::Heap(Heap &&other)
+    : allocated(other.allocated), live_after_gc(other.live_after_gc),
+      live_objects(other.live_objects), next_gc(other.next_gc),
+      max_heap(other.max_heap), base(other.base), hash_cons(other.hash_cons),
+      gc_threads(other.gc_threads), collector(other.collector) {
+  other.finish_sweep();
+  objects = std::move(other.objects);
+  interned = std::move(other.interned);
+  to_space = std::move(other.to_space);
+  code = std::move(other.code);
+}
 Heap &Heap::operator=(Heap other) {
+  finish_sweep();
   swap(*this, other);
   return *this;
 }
 
+// the batch the current thread is allocating into, if any
+static thread_local Heap::Batch *current_batch = nullptr;
+
+void Heap::use_batch(Batch *batch) { current_batch = batch; }
+
 // Should be used as heap.manage(new some_object);
 // adds the newly created objects address to the heap's record,
 // marking it as unused by default
 SExp *Heap::manage(SExp *new_object) {
-  objects[new_object] = false;
+  if (current_batch && current_batch->heap == this) {
+    // parallel primitives don't run while hash consing, so there's nothing
+    // to look up. Each thread only sees its own share of the heap, which is
+    // enough to stop runaway allocation
+    std::size_t bytes = Footprint().of(new_object);
+    current_batch->objects.push_back(std::make_pair(new_object, bytes));
+    current_batch->bytes += bytes;
+    if (max_heap && allocated + current_batch->bytes > max_heap) {
+      throw evaluation_error("Heap limit of " + std::to_string(max_heap) +
+                             " bytes exceeded");
+    }
+    if (Budget *budget = Budget::active()) {
+      budget->allocate(bytes);
+    }
+    return new_object;
+  }
+  if (hash_cons && is_internable(new_object)) {
+    auto canonical = interned.insert(new_object);
+    if (!canonical.second) {
+      // an equal value already exists: use that instead
+      delete new_object;
+      CoroutineState::hold(*canonical.first);
+      return *canonical.first;
+    }
+  }
+  std::size_t bytes = Footprint().of(new_object);
+  Record &record = objects[new_object];
+  record.marked = false;
+  record.bytes = bytes;
+  allocated += bytes;
+  // the object is recorded first, so the next collection will still free
+  // it after the error unwinds the evaluation
+  check_limit();
+  if (Budget *budget = Budget::active()) {
+    budget->allocate(bytes);
+  }
+  CoroutineState::hold(new_object);
   return new_object;
 }
 
+void Heap::check_limit() {
+  if (max_heap && allocated > max_heap) {
+    throw evaluation_error("Heap limit of " + std::to_string(max_heap) +
+                           " bytes exceeded");
+  }
+}
+
+void Heap::reserve(std::size_t bytes) const {
+  std::size_t used = allocated;
+  if (current_batch && current_batch->heap == this) {
+    used += current_batch->bytes;
+  }
+  if (max_heap && bytes > max_heap - std::min(used, max_heap)) {
+    throw evaluation_error("Heap limit of " + std::to_string(max_heap) +
+                           " bytes exceeded");
+  }
+  if (Budget *budget = Budget::active()) {
+    budget->check_allocation(bytes);
+  }
+}
+
+void Heap::merge(Batch &batch) {
+  objects.reserve(objects.size() + batch.objects.size());
+  for (auto it = batch.objects.begin(); it != batch.objects.end(); ++it) {
+    Record &record = objects[it->first];
+    record.marked = false;
+    record.bytes = it->second;
+  }
+  allocated += batch.bytes;
+  batch.objects.clear();
+  batch.bytes = 0;
+}
+
+// the immutable value types, which can be shared when they are equal
+bool Heap::is_internable(SExp *addr) {
+  auto &type = typeid(*addr);
+  return type == typeid(Number) || type == typeid(String) ||
+         type == typeid(Bool) || type == typeid(Atom) || type == typeid(List);
+}
+
+// Hash and compare values by content. Everything in a list is itself
+// interned, so lists are equal when they hold the same addresses
+std::size_t Heap::InternHash::operator()(SExp *addr) const {
+  auto &type = typeid(*addr);
+  std::size_t hash = type.hash_code();
+  if (type == typeid(Number)) {
+    hash ^= std::hash<double>()(static_cast<Number *>(addr)->val());
+  } else if (type == typeid(String)) {
+    hash ^= std::hash<std::string_view>()(static_cast<String *>(addr)->val());
+  } else if (type == typeid(Bool)) {
+    hash ^= std::hash<bool>()(static_cast<Bool *>(addr)->val());
+  } else if (type == typeid(Atom)) {
+    hash ^= std::hash<std::string>()(static_cast<Atom *>(addr)->get_identifier());
+  } else if (type == typeid(List)) {
+    auto &elems = static_cast<List *>(addr)->elems;
+    for (auto it = elems.begin(); it != elems.end(); ++it) {
+      hash = hash * 31 + std::hash<SExp *>()(*it);
+    }
+  }
+  return hash;
+}
+
+bool Heap::InternEqual::operator()(SExp *a, SExp *b) const {
+  auto &type = typeid(*a);
+  if (type != typeid(*b)) {
+    return false;
+  }
+  if (type == typeid(Number)) {
+    // compare the bits, so that a NaN can be found again to remove it
+    double x = static_cast<Number *>(a)->val();
+    double y = static_cast<Number *>(b)->val();
+    return std::memcmp(&x, &y, sizeof(double)) == 0;
+  } else if (type == typeid(String)) {
+    return static_cast<String *>(a)->val() == static_cast<String *>(b)->val();
+  } else if (type == typeid(Bool)) {
+    return static_cast<Bool *>(a)->val() == static_cast<Bool *>(b)->val();
+  } else if (type == typeid(Atom)) {
+    return static_cast<Atom *>(a)->get_identifier() ==
+           static_cast<Atom *>(b)->get_identifier();
+  } else if (type == typeid(List)) {
+    return static_cast<List *>(a)->elems == static_cast<List *>(b)->elems;
+  }
+  return a == b;
+}
+
+// With no better information, wait until some allocation has happened
+static const std::size_t min_gc_bytes = 1 << 22;
+// collect when the heap has grown this many times past its live size
+static const std::size_t gc_growth = 2;
+
+void Heap::set_max_heap(std::size_t bytes) {
+  max_heap = bytes;
+  set_next_gc();
+}
+
+// choose the heap size at which the next collection is due
+void Heap::set_next_gc() {
+  next_gc = std::max(live_after_gc * gc_growth, live_after_gc + min_gc_bytes);
+  if (max_heap && max_heap > live_after_gc) {
+    // near the limit, collect early enough to have a chance of staying
+    // under it
+    next_gc = std::min(next_gc, live_after_gc + (max_heap - live_after_gc) / 2);
+  }
+}
+
 // The heap class is responsible for managing the memory usage of
 // the program, so it's destructor must clean up all the memory it
 // was responsible for
 Heap::~Heap() {
+  finish_sweep();
+  std::vector<SExp *> garbage;
   for (auto it = objects.begin(); it != objects.end(); ++it) {
-    delete it->first;
+    garbage.push_back(it->first);
+  }
+  free_garbage(std::move(garbage), std::move(to_space));
+  finish_sweep();
+}
+
+// objects copied into an arena by the collector were constructed in place,
+// so they are destroyed in place: everything else came from new
+static void destroy(SExp *ptr, const Arena &arena) {
+  if (arena.contains(ptr)) {
+    ptr->~SExp();
+  } else {
+    delete ptr;
   }
 }
 
 // First phase of mark and sweep: mark everything as unused
 void Heap::reset_marks() {
   for (auto it = objects.begin(); it != objects.end(); ++it) {
-    it->second = false;
+    it->second.marked = false;
+  }
+}
+
+// wait for the deletion of the previous collection's garbage to finish
+void Heap::finish_sweep() {
+  if (sweeper.joinable()) {
+    sweeper.join();
   }
 }
 
 // sweep memory, cleaning up anything marked for deletion.
 void Heap::sweep() {
+  std::vector<SExp *> garbage;
   // the use of it and next is to avoid invalidating it when we remove it
   // from the table
   for (auto it = objects.begin(), next = objects.begin(); it != objects.end();
@@ -42,59 +312,533 @@ void Heap::sweep() {
     next = it;
     ++next;
 
-    if (!(it->second)) {
-      SExp *ptr = it->first; // get address
-      objects.erase(it);     // remove entry from object table
-      delete ptr;            // cleanup memory
+    if (!(it->second.marked)) {
+      allocated -= it->second.bytes;
+      // drop dead values from the table of canonical ones. Only the object
+      // itself is removed, not an equal one which has replaced it
+      auto canonical = interned.find(it->first);
+      if (canonical != interned.end() && *canonical == it->first) {
+        interned.erase(canonical);
+      }
+      // the space of one copied into the arena is only reclaimed by the
+      // next copying collection
+      if (to_space.contains(it->first)) {
+        it->first->~SExp();
+      } else {
+        garbage.push_back(it->first); // get address
+      }
+      objects.erase(it); // remove entry from object table
     }
   }
+  free_garbage(std::move(garbage), Arena());
 }
 
-// mark an object and any objects it contains pointers to as reachable
-void Heap::mark(SExp *addr) {
+// destroy the objects in garbage, then release the arena they may have
+// been copied into. The garbage is no longer in the object table, so
+// nothing else can see it: it is safe to free it while the interpreter
+// keeps running
+void Heap::free_garbage(std::vector<SExp *> garbage, Arena from_space) {
+  finish_sweep();
+  auto cleanup = [](std::vector<SExp *> garbage, Arena from_space) {
+    for (auto ptr = garbage.begin(); ptr != garbage.end(); ++ptr) {
+      destroy(*ptr, from_space); // cleanup memory
+    }
+    from_space.clear();
+  };
+  if (gc_threads == 1) {
+    cleanup(std::move(garbage), std::move(from_space));
+    return;
+  }
+  sweeper = std::thread(cleanup, std::move(garbage), std::move(from_space));
+}
+
+bool Heap::in_base(SExp *addr) const {
+  for (const Heap *h = base; h; h = h->base) {
+    if (h->objects.count(addr) || h->code.contains(addr)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// set the mark bit of a managed object, returning false if it was
+// already set
+bool Heap::try_mark(SExp *addr) {
   auto entry = objects.find(addr);
   if (entry == objects.end()) {
+    if (code.contains(addr) || in_base(addr)) {
+      // code is always live, and only refers to other code. So is the
+      // base, which can't refer to this heap
+      return false;
+    }
     // this should never happen
     throw implementation_error(
         "Garbage collector encountered unmanaged address");
   }
-  if (entry->second) {
-    // if the object is already marked, avoid cycles
-    return;
-  }
-  entry->second = true; // mark address as in use
-
-  // Lists and user-defined functions can contain references to other objects:
-  // we need to mark the objects they reference as in use as well
+  // exchange, rather than test then set, so that two threads can never both
+  // claim the same object
+  return !entry->second.marked.exchange(true);
+}
 
+// Lists and user-defined functions can contain references to other objects:
+// call f on every object that addr holds a reference to
+template <typename F> void Heap::for_each_child(SExp *addr, F f) {
   if (typeid(*addr) == typeid(List)) {
     auto list = static_cast<List *>(addr);
     for (auto it = list->elems.begin(); it != list->elems.end(); ++it) {
-      mark(*it);
+      f(*it);
     }
   }
   if (typeid(*addr) == typeid(LambdaFunction)) {
     auto lambda = static_cast<LambdaFunction *>(addr);
-    // mark the expressions in the function body
+    // the expressions in the function body
     for (auto obj = lambda->body.begin(); obj != lambda->body.end(); ++obj) {
-      mark(*obj);
+      f(*obj);
     }
-    // mark the expressions pointed to by the functions closure
+    // the expressions pointed to by the functions closure
     for (auto obj = lambda->closure.scope.begin();
          obj != lambda->closure.scope.end(); ++obj) {
-      mark(obj->second);
+      f(obj->second);
+    }
+  }
+  if (typeid(*addr) == typeid(Coroutine)) {
+    auto coroutine = static_cast<Coroutine *>(addr);
+    if (coroutine->state->fn) {
+      f(coroutine->state->fn);
+    }
+    coroutine->state->for_each_held(f);
+  }
+}
+
+// This walks the objects without marking them, since it runs outside a
+// collection
+std::unordered_set<CoroutineState *>
+Heap::reachable_coroutines(const std::vector<SExp *> &roots) {
+  std::unordered_set<CoroutineState *> reached;
+  std::unordered_set<SExp *> seen;
+  std::vector<SExp *> stack(roots);
+  while (!stack.empty()) {
+    SExp *addr = stack.back();
+    stack.pop_back();
+    if (!seen.insert(addr).second) {
+      continue;
+    }
+    if (typeid(*addr) == typeid(Coroutine) &&
+        static_cast<Coroutine *>(addr)->state->suspended()) {
+      reached.insert(static_cast<Coroutine *>(addr)->state.get());
+    }
+    for_each_child(addr, [&stack](SExp *child) { stack.push_back(child); });
+  }
+  return reached;
+}
+
+// mark an object and any objects it contains pointers to as reachable.
+// This uses an explicit stack rather than recursion so that very long
+// chains of references can't overflow the c++ stack
+void Heap::mark(SExp *root) {
+  std::vector<SExp *> stack{root};
+  while (!stack.empty()) {
+    SExp *addr = stack.back();
+    stack.pop_back();
+    // if the object is already marked, avoid cycles
+    if (try_mark(addr)) {
+      for_each_child(addr, [&stack](SExp *child) { stack.push_back(child); });
+    }
+  }
+}
+
+// Each marking thread works from a private stack, and shares half of it
+// through its deque when it gets large. Threads that run out of work take
+// from their own deque, then steal from the other end of everyone else's.
+namespace {
+struct MarkDeque {
+  std::mutex lock;
+  std::deque<SExp *> items;
+};
+}
+
+void Heap::parallel_mark(const std::vector<SExp *> &roots) {
+  std::vector<MarkDeque> deques(gc_threads);
+  // deal the roots out between the threads
+  for (std::size_t i = 0; i < roots.size(); ++i) {
+    deques[i % gc_threads].items.push_back(roots[i]);
+  }
+  // number of threads which might still produce work
+  std::atomic<unsigned> active(gc_threads);
+  std::exception_ptr error;
+  std::mutex error_lock;
+
+  auto take = [&deques, this](unsigned self, SExp *&out) -> bool {
+    for (unsigned i = 0; i < gc_threads; ++i) {
+      MarkDeque &d = deques[(self + i) % gc_threads];
+      std::lock_guard<std::mutex> guard(d.lock);
+      if (!d.items.empty()) {
+        if (i == 0) {
+          out = d.items.back();
+          d.items.pop_back();
+        } else {
+          out = d.items.front();
+          d.items.pop_front();
+        }
+        return true;
+      }
     }
+    return false;
+  };
+
+  auto worker = [&, this](unsigned self) {
+    std::vector<SExp *> stack;
+    try {
+      while (true) {
+        SExp *addr;
+        if (!stack.empty()) {
+          addr = stack.back();
+          stack.pop_back();
+        } else if (!take(self, addr)) {
+          // out of work: wait until either someone shares some or every
+          // thread is idle, at which point marking is complete
+          --active;
+          while (!take(self, addr)) {
+            if (active == 0) {
+              return;
+            }
+            std::this_thread::yield();
+          }
+          ++active;
+        }
+        if (try_mark(addr)) {
+          for_each_child(addr,
+                         [&stack](SExp *child) { stack.push_back(child); });
+        }
+        if (stack.size() > mark_spill_size) {
+          MarkDeque &mine = deques[self];
+          std::lock_guard<std::mutex> guard(mine.lock);
+          auto half = stack.begin() + stack.size() / 2;
+          mine.items.insert(mine.items.end(), stack.begin(), half);
+          stack.erase(stack.begin(), half);
+        }
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> guard(error_lock);
+      error = std::current_exception();
+      // stop the other threads from waiting on this one
+      --active;
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < gc_threads; ++i) {
+    threads.push_back(std::thread(worker, i));
+  }
+  worker(0);
+  for (auto it = threads.begin(); it != threads.end(); ++it) {
+    it->join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+// The relocator copies an object into memory reserved for it in the to-space,
+// replacing each reference it holds with the new address of the object
+// referred to. Every object in forward must have had memory reserved before
+// any copies are made, so that forward references can be translated.
+class Heap::Relocator : public SExpVisitor {
+private:
+  std::unordered_map<SExp *, SExp *> &forward;
+  void *target;
+
+public:
+  // objects which weren't moved, like code, keep their address
+  SExp *translate(SExp *addr) {
+    auto entry = forward.find(addr);
+    return entry == forward.end() ? addr : entry->second;
+  }
+  Relocator(std::unordered_map<SExp *, SExp *> &forward)
+      : forward(forward), target(nullptr) {}
+  void copy(SExp *from, SExp *to) {
+    target = to;
+    from->exec(*this);
+  }
+  void visit(Number &number) { new (target) Number(number.val()); }
+  void visit(String &string) { new (target) String(string); }
+  void visit(Bool &boolean) { new (target) Bool(boolean.val()); }
+  void visit(Atom &atom) { new (target) Atom(atom.get_identifier()); }
+  void visit(List &list) {
+    std::list<SExp *> elems;
+    for (auto it = list.elems.begin(); it != list.elems.end(); ++it) {
+      elems.push_back(translate(*it));
+    }
+    new (target) List(std::move(elems));
+  }
+  void visit(PrimitiveFunction &fn) { new (target) PrimitiveFunction(fn); }
+  void visit(LambdaFunction &lambda) {
+    Env closure = lambda.closure;
+    for (auto it = closure.scope.begin(); it != closure.scope.end(); ++it) {
+      it->second = translate(it->second);
+    }
+    std::list<SExp *> body;
+    for (auto it = lambda.body.begin(); it != lambda.body.end(); ++it) {
+      body.push_back(translate(*it));
+    }
+    new (target) LambdaFunction(closure, lambda.params, body);
+  }
+  // ports are pinned, so are never copied
+  void visit(InPort &in) {
+    throw implementation_error("Attempted to relocate an input port");
   }
-  return;
+  void visit(OutPort &out) {
+    throw implementation_error("Attempted to relocate an output port");
+  }
+  void visit(Eof &eof) { new (target) Eof(); }
+  // the old copies of vectors are garbage once they have been moved, so
+  // their contents are taken rather than copied
+  void visit(Bytevector &bytes) {
+    new (target) Bytevector(std::move(bytes.bytes));
+  }
+  void visit(NumberVector &vec) {
+    new (target) NumberVector(std::move(vec.values));
+  }
+  void visit(StringVector &vec) {
+    new (target) StringVector(std::move(vec.chars), std::move(vec.ends));
+  }
+  void visit(Future &future) { new (target) Future(std::move(future.state)); }
+  void visit(Channel &channel) {
+    new (target) Channel(std::move(channel.state));
+  }
+  // nothing is moved while coroutines are part way through, so the only
+  // reference one can have is to the function it hasn't called yet
+  void visit(Coroutine &coroutine) {
+    auto state = std::move(coroutine.state);
+    state->fn = state->fn ? translate(state->fn) : nullptr;
+    new (target) Coroutine(std::move(state));
+  }
+};
+
+// objects which hold open streams can't be copied, so are left in place
+static bool is_pinned(SExp *addr) {
+  return typeid(*addr) == typeid(InPort) || typeid(*addr) == typeid(OutPort);
 }
 
-// naive mark-and-sweep: mark all objects pointed to by names in the symbol
+// The importer makes a deep copy of a value from another interpreter's heap,
+// so that the interpreters never share anything the collector manages.
+// Anything shared within the value is shared in the copy. Builtins, eof and
+// the standard ports aren't copied, but replaced with the receiving
+// interpreter's own, while futures and channels share the state behind
+// them, which is how interpreters talk to each other. Other ports can't be
+// passed on.
+class Heap::Importer : public SExpVisitor {
+private:
+  Heap &heap;
+  GlobalEnv &from;
+  GlobalEnv &to;
+  std::unordered_map<SExp *, SExp *> copies;
+  SExp *result;
+  // the copy of the value bound to id in from, if that's what value is.
+  // Functions from an interpreter's base refer to the base's bindings
+  bool standard(SExp *value, const std::string &id) {
+    for (GlobalEnv *g = &from; g; g = g->get_base()) {
+      if (value == g->lookup(id)) {
+        result = to.lookup(id);
+        return true;
+      }
+    }
+    return false;
+  }
+
+public:
+  Importer(Heap &heap, GlobalEnv &from, GlobalEnv &to)
+      : heap(heap), from(from), to(to), result(nullptr) {}
+  SExp *copy(SExp *addr) {
+    auto done = copies.find(addr);
+    if (done != copies.end()) {
+      return done->second;
+    }
+    addr->exec(*this);
+    copies[addr] = result;
+    return result;
+  }
+  void visit(Number &number) { result = heap.manage(new Number(number.val())); }
+  void visit(String &string) { result = heap.manage(new String(string)); }
+  void visit(Bool &boolean) { result = heap.manage(new Bool(boolean.val())); }
+  void visit(Atom &atom) {
+    result = heap.manage(new Atom(atom.get_identifier()));
+  }
+  void visit(List &list) {
+    std::list<SExp *> elems;
+    for (auto it = list.elems.begin(); it != list.elems.end(); ++it) {
+      elems.push_back(copy(*it));
+    }
+    result = heap.manage(new List(std::move(elems)));
+  }
+  void visit(PrimitiveFunction &fn) {
+    auto own = dynamic_cast<PrimitiveFunction *>(to.lookup(fn.get_name()));
+    if (own && own->get_name() == fn.get_name()) {
+      result = own;
+    } else {
+      result = heap.manage(new PrimitiveFunction(fn));
+    }
+  }
+  void visit(LambdaFunction &lambda) {
+    std::unordered_map<std::string, SExp *> scope;
+    for (auto it = lambda.closure.scope.begin();
+         it != lambda.closure.scope.end(); ++it) {
+      scope[it->first] = copy(it->second);
+    }
+    std::list<SExp *> body;
+    for (auto it = lambda.body.begin(); it != lambda.body.end(); ++it) {
+      body.push_back(copy(*it));
+    }
+    result = heap.manage(
+        new LambdaFunction(Env(to, std::move(scope)), lambda.params, body));
+  }
+  void visit(InPort &in) {
+    if (!standard(&in, "std-input-port")) {
+      throw evaluation_error("Cannot pass input port " + in.get_name() +
+                             " to another interpreter");
+    }
+  }
+  void visit(OutPort &out) {
+    if (!standard(&out, "std-output-port")) {
+      throw evaluation_error("Cannot pass output port " + out.get_name() +
+                             " to another interpreter");
+    }
+  }
+  void visit(Eof &eof) { result = to.lookup("eof"); }
+  void visit(Bytevector &bytes) {
+    result = heap.manage(new Bytevector(bytes.bytes));
+  }
+  void visit(NumberVector &vec) {
+    result = heap.manage(new NumberVector(vec.values));
+  }
+  // the characters are immutable, so they can be shared between threads
+  void visit(StringVector &vec) {
+    result = heap.manage(new StringVector(vec.chars, vec.ends));
+  }
+  void visit(Future &future) { result = heap.manage(new Future(future.state)); }
+  void visit(Channel &channel) {
+    result = heap.manage(new Channel(channel.state));
+  }
+  // a coroutine's stack is full of references into the heap it came from
+  void visit(Coroutine &coroutine) {
+    throw evaluation_error("Cannot pass a coroutine to another interpreter");
+  }
+};
+
+std::vector<SExp *> Heap::import(const std::vector<SExp *> &values,
+                                 GlobalEnv &from, GlobalEnv &to) {
+  Importer importer(*this, from, to);
+  std::vector<SExp *> copies;
+  for (auto it = values.begin(); it != values.end(); ++it) {
+    copies.push_back(importer.copy(*it));
+  }
+  return copies;
+}
+
+// Cheney style copying collection: find every reachable object breadth first
+// from the roots, reserve space for each in that order in a new arena, then
+// copy them all across. The old objects are all garbage afterwards.
+void Heap::copy_collect(Env &env) {
+  std::vector<SExp *> order;
+  std::unordered_map<SExp *, SExp *> forward;
+  auto reach = [&order, &forward, this](SExp *addr) {
+    if (forward.count(addr) || code.contains(addr) || in_base(addr)) {
+      return;
+    }
+    if (objects.find(addr) == objects.end()) {
+      throw implementation_error(
+          "Garbage collector encountered unmanaged address");
+    }
+    forward[addr] = addr;
+    order.push_back(addr);
+  };
+  for (auto entry = env.scope.begin(); entry != env.scope.end(); ++entry) {
+    reach(entry->second);
+  }
+  for (std::size_t i = 0; i < order.size(); ++i) {
+    for_each_child(order[i], reach);
+  }
+
+  Arena from_space = std::move(to_space);
+  to_space = Arena();
+  ObjectSize size;
+  for (auto it = order.begin(); it != order.end(); ++it) {
+    if (!is_pinned(*it)) {
+      forward[*it] = static_cast<SExp *>(to_space.allocate(size.of(*it)));
+    }
+  }
+  Relocator relocator(forward);
+  for (auto it = order.begin(); it != order.end(); ++it) {
+    if (!is_pinned(*it)) {
+      relocator.copy(*it, forward[*it]);
+    }
+  }
+  for (auto entry = env.scope.begin(); entry != env.scope.end(); ++entry) {
+    entry->second = relocator.translate(entry->second);
+  }
+
+  // everything except the pinned objects left behind is now garbage
+  std::vector<SExp *> garbage;
+  for (auto it = objects.begin(); it != objects.end(); ++it) {
+    if (!is_pinned(it->first) || !forward.count(it->first)) {
+      garbage.push_back(it->first);
+    }
+  }
+  std::unordered_map<SExp *, std::size_t> bytes;
+  for (auto it = order.begin(); it != order.end(); ++it) {
+    bytes[forward[*it]] = objects[*it].bytes;
+  }
+  // the copies of canonical values are canonical: lists are hashed by the
+  // addresses they contain, so the table has to be rebuilt from scratch
+  if (hash_cons) {
+    interned.clear();
+    for (auto it = order.begin(); it != order.end(); ++it) {
+      if (is_internable(*it)) {
+        interned.insert(forward[*it]);
+      }
+    }
+  }
+  objects.clear();
+  allocated = 0;
+  for (auto it = bytes.begin(); it != bytes.end(); ++it) {
+    Record &record = objects[it->first];
+    record.marked = false;
+    record.bytes = it->second;
+    allocated += it->second;
+  }
+  free_garbage(std::move(garbage), std::move(from_space));
+}
+
+// collect garbage with whichever collector the heap is using, marking and
+// sweeping when the objects can't be moved, then decide how much can be
+// allocated before the next collection
+
+void Heap::collect_garbage(Env &env, bool can_move) {
+  if (collector == Collector::copying && can_move) {
+    copy_collect(env);
+  } else {
+    mark_sweep(env);
+  }
+  live_after_gc = allocated;
+  live_objects = objects.size();
+  set_next_gc();
+}
+
+// mark-and-sweep: mark all objects pointed to by names in the symbol
 // table as in use, then collect all unmarked memory managed by the heap.
 
-void Heap::collect_garbage(Env &env) {
+void Heap::mark_sweep(Env &env) {
   reset_marks();
-  for (auto entry = env.scope.begin(); entry != env.scope.end(); ++entry) {
-    mark(entry->second);
+  if (gc_threads > 1 && objects.size() >= parallel_mark_threshold) {
+    std::vector<SExp *> roots;
+    for (auto entry = env.scope.begin(); entry != env.scope.end(); ++entry) {
+      roots.push_back(entry->second);
+    }
+    parallel_mark(roots);
+  } else {
+    for (auto entry = env.scope.begin(); entry != env.scope.end(); ++entry) {
+      mark(entry->second);
+    }
   }
   sweep();
 }
@@ -1,10 +1,16 @@
 #ifndef HEAP_H
 #define HEAP_H
 
+#include "arena.h"
 #include "lisp_exceptions.h"
+#include <atomic>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 
+class CoroutineState;
 class Env;
 class GlobalEnv;
 class SExp;
@@ -18,22 +24,181 @@ using a mark-and-sweep algorithm from the symbol table to determine
 which s-exp objects are still reachable from current environment, and
 deleting unreachable memory
 
+On large heaps the mark phase is shared between several worker threads,
+each with its own mark stack, which steal work from each other when they
+run out. Dead objects are deleted on a background thread, so the
+interpreter can carry on while their memory is returned.
+
+Alternatively the heap can run as a copying collector. Rather than sweeping,
+every live object is copied breadth first from the roots into a fresh
+arena, so that related objects (a list and its elements, a closure and its
+environment) end up next to each other, and all references to them are
+updated. Ports wrap open streams and cannot be copied: they stay where they
+are.
+
+Collections are only safe between top level forms, when nothing but the
+global scope refers to live data. Rather than collecting at every such
+point, the heap keeps a rough count of the bytes it manages, and asks for a
+collection once the allocation since the last one has grown past a
+threshold proportional to the data that survived it. An optional hard
+limit on the heap size turns runaway allocation into an evaluation error.
+
+Parsed program text is not kept in the collected heap at all, but in a
+separate code arena (see arena.h) which the collector skips over.
+
+A heap can be layered over a base heap, whose objects it may refer to. The
+base must not change while the layer exists, so that nothing in it refers
+back into the layer: the collector treats the base's objects like code,
+as always live and holding nothing it needs to follow. Mark bits are kept
+in the heap's table rather than in the objects, so collecting a layer
+writes nothing to the base. Evaluating in a layer can still change a few
+things the base holds: bytevector-u8-set! changes a base bytevector's
+bytes, reading from a base port moves it along, and a base channel keeps
+what is put in it. None of these leave the base referring into the layer,
+since a bytevector holds only bytes and a channel copies values into a
+heap of its own, and the base's coroutines, which would, can't be resumed
+while it has a layer (see coroutine.h). What a layer changes this way is
+seen by the next layer over the same base. A base heap built before a
+fork stays shared between the processes, apart from the pages holding
+whatever was changed, which are copied as usual when written.
+
+Since lisp values are immutable, the heap can optionally hash cons them:
+manage looks each new number, string, boolean, atom or list up in a table
+of canonical instances, and returns the existing one if there is an equal
+value already. Equal values are then always the same object, so they can
+be compared by address. The table is weak: it doesn't keep its entries
+alive, and they are dropped when they are collected. Hash consing shares
+parsed code with data, so code goes in the heap rather than the arena.
+
+The object table isn't safe to update from several threads. Parallel
+primitives (see pool.h) give each of their threads a batch, and while a
+thread has one, manage records new objects in it rather than in the table.
+The batches are merged into the table once the threads are done. Since
+that all happens within one top level form, a collection never has to stop
+a thread which is still allocating.
 */
 
+enum class Collector { mark_sweep, copying };
+
 class Heap {
 private:
-  std::unordered_map<SExp *, bool> objects;
+  struct Record {
+    // the mark bits are atomic so that several threads can mark at once
+    std::atomic<bool> marked;
+    std::size_t bytes; // approximate memory used by the object
+  };
+  std::unordered_map<SExp *, Record> objects;
+  std::size_t allocated;     // total bytes of all managed objects
+  std::size_t live_after_gc; // bytes which survived the last collection
+  std::size_t live_objects;  // objects which survived the last collection
+  std::size_t next_gc;       // collect once allocated reaches this
+  std::size_t max_heap;      // hard limit on allocated, or 0 for none
+  const Heap *base;          // the heap this one is layered over, if any
+  void set_next_gc();
+  // whether addr belongs to a heap this one is layered over
+  bool in_base(SExp *addr) const;
+  // canonical instances of values, when hash consing
+  struct InternHash {
+    std::size_t operator()(SExp *) const;
+  };
+  struct InternEqual {
+    bool operator()(SExp *, SExp *) const;
+  };
+  bool hash_cons;
+  std::unordered_set<SExp *, InternHash, InternEqual> interned;
+  static bool is_internable(SExp *);
+  // visitors used to size and move objects
+  class ObjectSize;
+  class Footprint;
+  class Relocator;
+  class Importer;
+  unsigned gc_threads;
+  Collector collector;
+  // holds the objects which survived the last copying collection
+  Arena to_space;
+  CodeArena code;
+  // thread deleting the garbage found by the last collection
+  std::thread sweeper;
   void reset_marks();
+  bool try_mark(SExp *);
+  template <typename F> void for_each_child(SExp *, F);
   void mark(SExp *);
+  void parallel_mark(const std::vector<SExp *> &roots);
   void sweep();
+  void free_garbage(std::vector<SExp *> garbage, Arena from_space);
+  void mark_sweep(Env &env);
+  void copy_collect(Env &env);
   void swap(Heap& a, Heap&b) {
   	std::swap(a.objects, b.objects);
+  	std::swap(a.allocated, b.allocated);
+  	std::swap(a.live_after_gc, b.live_after_gc);
+  	std::swap(a.live_objects, b.live_objects);
+  	std::swap(a.next_gc, b.next_gc);
+  	std::swap(a.max_heap, b.max_heap);
+  	std::swap(a.base, b.base);
+  	std::swap(a.hash_cons, b.hash_cons);
+  	std::swap(a.interned, b.interned);
+  	std::swap(a.gc_threads, b.gc_threads);
+  	std::swap(a.collector, b.collector);
+  	std::swap(a.to_space, b.to_space);
+  	std::swap(a.code, b.code);
   }
 public:
+  // objects managed by one thread of a parallel primitive
+  struct Batch {
+    Heap *heap; // other heaps used by the thread still manage their own
+    std::vector<std::pair<SExp *, std::size_t>> objects;
+    std::size_t bytes = 0;
+  };
+  // record the objects this thread manages in batch, until it's given null
+  static void use_batch(Batch *batch);
+  // add the objects from a batch to the table: this may go over the limit
+  // on the heap size, so check_limit should be called after the last one
+  void merge(Batch &batch);
+  // throw if the heap has grown past its limit
+  void check_limit();
+  // throw the error manage would for an object of bytes, before it is made,
+  // so that one too big for the limits is never allocated at all
+  void reserve(std::size_t bytes) const;
   SExp *manage(SExp *new_object);
-  void collect_garbage(Env &env);
-  
-  Heap() {}
+  // copy values, and everything they refer to, out of the interpreter from
+  // and into this heap, which belongs to the interpreter to
+  std::vector<SExp *> import(const std::vector<SExp *> &values,
+                             GlobalEnv &from, GlobalEnv &to);
+  CodeArena &code_arena() { return code; }
+  // can_move is false while something outside the heap, like a suspended
+  // coroutine's stack, has the addresses of objects
+  void collect_garbage(Env &env, bool can_move = true);
+  // wait for the garbage found by the last collection to be deleted, so
+  // nothing is left running in the background
+  void finish_sweep();
+  // number of threads used by the collector: 1 makes it fully serial
+  void set_gc_threads(unsigned n) { gc_threads = n > 0 ? n : 1; }
+  void set_collector(Collector c) { collector = c; }
+  Collector get_collector() const { return collector; }
+  unsigned get_gc_threads() const { return gc_threads; }
+  // limit the heap to roughly this many bytes: 0 means no limit
+  void set_max_heap(std::size_t bytes);
+  std::size_t get_max_heap() const { return max_heap; }
+  // share equal values: this must be chosen before anything is managed
+  void set_hash_consing(bool on) { hash_cons = on; }
+  bool hash_consing() const { return hash_cons; }
+  // refer to objects in base, which must outlive this heap and not change
+  void set_base(const Heap *b) { base = b; }
+
+  // true once enough has been allocated since the last collection to make
+  // another worthwhile
+  bool wants_collection() const { return allocated >= next_gc; }
+  // the coroutines which have started, and not returned, that can be
+  // reached from roots
+  std::unordered_set<CoroutineState *>
+  reachable_coroutines(const std::vector<SExp *> &roots);
+  std::size_t bytes_since_gc() const { return allocated - live_after_gc; }
+  std::size_t objects_since_gc() const {
+    return objects.size() - live_objects;
+  }
+
+  Heap();
   Heap(Heap &&other);
   // Move assignment operator.
   Heap &operator=(Heap);
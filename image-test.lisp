@@ -0,0 +1,7 @@
+;;This script is run from an image saved from zip.lisp, so zip is already defined without loading it:
+;;	./main --save-image zip.img zip.lisp
+;;	./main --image zip.img image-test.lisp
+;;make image-test does this, and checks that an image too big for --max-heap is refused with an error
+
+(displayln (zip '(a b c) '(1 2 3)))
+(displayln (map (lambda (pair) (car (cdr pair))) (zip '(x y) '("one" "two"))))
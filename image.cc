@@ -0,0 +1,478 @@
+#include "image.h"
+#include "env.h"
+#include "iobuf.h"
+#include "lisp_exceptions.h"
+#include "sexp.h"
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// the start of every image, naming the version of the format
+static const char magic[8] = {'L', 'I', 'S', 'P', 'I', 'M', 'G', '1'};
+
+// the kinds of record in an image. Names are written once, the first time
+// they are used, and referred to by their position among the names, as
+// objects are among the objects and scopes among the scopes. The last
+// record says which scope is the global one
+enum class Record : std::uint8_t {
+  name,
+  number,
+  string,
+  boolean,
+  atom,
+  list,
+  builtin,
+  lambda,
+  scope,
+  bytevector,
+  number_vector,
+  string_vector,
+  globals
+};
+
+using Scope = std::unordered_map<std::string, SExp *>;
+
+static const std::uint32_t no_base = 0xffffffff;
+
+// how many of the scopes written last are tried as the one a new scope is
+// written as changes to
+static const std::size_t base_candidates = 4;
+
+// the number of bindings which differ between from and to, or limit if
+// there are at least that many
+static std::size_t changes(const Scope &from, const Scope &to,
+                           std::size_t limit) {
+  std::size_t n = 0;
+  for (auto it = to.begin(); it != to.end() && n < limit; ++it) {
+    auto was = from.find(it->first);
+    if (was == from.end() || was->second != it->second) {
+      ++n;
+    }
+  }
+  for (auto it = from.begin(); it != from.end() && n < limit; ++it) {
+    if (!to.count(it->first)) {
+      ++n;
+    }
+  }
+  return n;
+}
+
+class ImageWriter : public SExpVisitor {
+private:
+  Env &env;
+  std::string &out;
+  std::unordered_map<SExp *, std::uint32_t> objects;
+  std::unordered_map<std::string, std::uint32_t> names;
+  std::vector<const Scope *> scopes; // in the order they were written
+
+  void put(Record kind) { out.push_back(static_cast<char>(kind)); }
+  template <typename T> void put(T value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+  void put_bytes(const char *data, std::size_t count) {
+    put(std::uint64_t(count));
+    out.append(data, count);
+  }
+  std::uint32_t name(const std::string &id) {
+    auto found = names.find(id);
+    if (found != names.end()) {
+      return found->second;
+    }
+    put(Record::name);
+    put_bytes(id.data(), id.size());
+    std::uint32_t index = names.size();
+    names[id] = index;
+    return index;
+  }
+  // a value which is bound to id in a new interpreter too
+  void builtin(const std::string &id) {
+    std::uint32_t n = name(id);
+    put(Record::builtin);
+    put(n);
+  }
+  bool standard(SExp *value, const std::string &id) {
+    if (value != env.lookup(id)) {
+      return false;
+    }
+    builtin(id);
+    return true;
+  }
+
+public:
+  ImageWriter(Env &env, std::string &out) : env(env), out(out) {
+    out.append(magic, sizeof(magic));
+  }
+  // write addr, and everything it refers to, if they haven't been already,
+  // returning its position
+  std::uint32_t write(SExp *addr) {
+    auto done = objects.find(addr);
+    if (done != objects.end()) {
+      return done->second;
+    }
+    addr->exec(*this);
+    std::uint32_t index = objects.size();
+    objects[addr] = index;
+    return index;
+  }
+  // write scope as the changes from whichever recent scope it is closest
+  // to, returning its position among the scopes
+  std::uint32_t write_scope(const Scope &scope) {
+    for (auto it = scope.begin(); it != scope.end(); ++it) {
+      name(it->first);
+      write(it->second);
+    }
+    std::uint32_t base = no_base;
+    std::size_t fewest = scope.size();
+    for (std::size_t i = scopes.size(), tried = 0;
+         i > 0 && tried < base_candidates; --i, ++tried) {
+      std::size_t n = changes(*scopes[i - 1], scope, fewest);
+      if (n < fewest) {
+        base = i - 1;
+        fewest = n;
+      }
+    }
+    std::vector<std::uint32_t> removed;
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> set;
+    if (base == no_base) {
+      for (auto it = scope.begin(); it != scope.end(); ++it) {
+        set.emplace_back(names[it->first], objects[it->second]);
+      }
+    } else {
+      const Scope &from = *scopes[base];
+      for (auto it = scope.begin(); it != scope.end(); ++it) {
+        auto was = from.find(it->first);
+        if (was == from.end() || was->second != it->second) {
+          set.emplace_back(names[it->first], objects[it->second]);
+        }
+      }
+      for (auto it = from.begin(); it != from.end(); ++it) {
+        if (!scope.count(it->first)) {
+          removed.push_back(names[it->first]);
+        }
+      }
+    }
+    put(Record::scope);
+    put(base);
+    put(std::uint32_t(removed.size()));
+    for (auto it = removed.begin(); it != removed.end(); ++it) {
+      put(*it);
+    }
+    put(std::uint32_t(set.size()));
+    for (auto it = set.begin(); it != set.end(); ++it) {
+      put(it->first);
+      put(it->second);
+    }
+    scopes.push_back(&scope);
+    return scopes.size() - 1;
+  }
+  void write_globals() {
+    std::uint32_t global = write_scope(env.scope);
+    put(Record::globals);
+    put(global);
+  }
+
+  void visit(Number &number) {
+    put(Record::number);
+    put(number.val());
+  }
+  void visit(String &string) {
+    put(Record::string);
+    put_bytes(string.val().data(), string.val().size());
+  }
+  void visit(Bool &boolean) {
+    put(Record::boolean);
+    put(std::uint8_t(boolean.val()));
+  }
+  void visit(Atom &atom) {
+    std::uint32_t n = name(atom.get_identifier());
+    put(Record::atom);
+    put(n);
+  }
+  void visit(List &list) {
+    std::vector<std::uint32_t> elems;
+    for (auto it = list.elems.begin(); it != list.elems.end(); ++it) {
+      elems.push_back(write(*it));
+    }
+    put(Record::list);
+    put(std::uint32_t(elems.size()));
+    for (auto it = elems.begin(); it != elems.end(); ++it) {
+      put(*it);
+    }
+  }
+  void visit(PrimitiveFunction &fn) { builtin(fn.get_name()); }
+  void visit(LambdaFunction &lambda) {
+    std::vector<std::uint32_t> params, body;
+    for (auto it = lambda.params.begin(); it != lambda.params.end(); ++it) {
+      params.push_back(name(*it));
+    }
+    for (auto it = lambda.body.begin(); it != lambda.body.end(); ++it) {
+      body.push_back(write(*it));
+    }
+    std::uint32_t closure = write_scope(lambda.closure.scope);
+    put(Record::lambda);
+    put(std::uint32_t(params.size()));
+    for (auto it = params.begin(); it != params.end(); ++it) {
+      put(*it);
+    }
+    put(std::uint32_t(body.size()));
+    for (auto it = body.begin(); it != body.end(); ++it) {
+      put(*it);
+    }
+    put(closure);
+  }
+  void visit(InPort &in) {
+    if (!standard(&in, "std-input-port")) {
+      throw evaluation_error("Cannot save input port " + in.get_name() +
+                             " in an image");
+    }
+  }
+  void visit(OutPort &out) {
+    if (!standard(&out, "std-output-port")) {
+      throw evaluation_error("Cannot save output port " + out.get_name() +
+                             " in an image");
+    }
+  }
+  void visit(Eof &eof) { builtin("eof"); }
+  void visit(Bytevector &bytes) {
+    put(Record::bytevector);
+    put_bytes(reinterpret_cast<const char *>(bytes.bytes.data()),
+              bytes.bytes.size());
+  }
+  void visit(NumberVector &vec) {
+    put(Record::number_vector);
+    put_bytes(reinterpret_cast<const char *>(vec.values.data()),
+              vec.values.size() * sizeof(double));
+  }
+  void visit(StringVector &vec) {
+    put(Record::string_vector);
+    put_bytes(vec.chars->data(), vec.chars->size());
+    put_bytes(reinterpret_cast<const char *>(vec.ends.data()),
+              vec.ends.size() * sizeof(std::size_t));
+  }
+  void visit(Future &future) {
+    throw evaluation_error("Cannot save a future in an image");
+  }
+  void visit(Channel &channel) {
+    throw evaluation_error("Cannot save a channel in an image");
+  }
+  void visit(Coroutine &coroutine) {
+    throw evaluation_error("Cannot save a coroutine in an image");
+  }
+};
+
+// the image is built in memory and written in one go, so that a value
+// which can't be saved doesn't leave half an image behind
+void save_image(GlobalEnv &env, const std::string &path) {
+  std::string image;
+  ImageWriter writer(env, image);
+  writer.write_globals();
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  file.write(image.data(), image.size());
+  file.close();
+  if (!file) {
+    throw io_error("Couldn't write image " + path);
+  }
+}
+
+class ImageReader {
+private:
+  GlobalEnv &env;
+  const std::string &path;
+  const char *pos;
+  const char *end;
+  std::vector<std::string> names;
+  std::vector<SExp *> objects;
+  // the scopes read so far. A lambda takes its scope over once it's read,
+  // rather than copying it, which leaves only a pointer to it here
+  std::vector<const Scope *> scopes;
+  std::vector<std::unique_ptr<Scope>> unclaimed;
+
+  [[noreturn]] void corrupt() {
+    throw io_error("Corrupt image " + path);
+  }
+  void need(std::size_t count) {
+    if (std::size_t(end - pos) < count) {
+      corrupt();
+    }
+  }
+  template <typename T> T get() {
+    need(sizeof(T));
+    T value;
+    std::memcpy(&value, pos, sizeof(value));
+    pos += sizeof(value);
+    return value;
+  }
+  std::string_view get_bytes() {
+    std::uint64_t count = get<std::uint64_t>();
+    need(count);
+    std::string_view bytes(pos, count);
+    pos += count;
+    return bytes;
+  }
+  const std::string &name() {
+    std::uint32_t i = get<std::uint32_t>();
+    if (i >= names.size()) {
+      corrupt();
+    }
+    return names[i];
+  }
+  SExp *object() {
+    std::uint32_t i = get<std::uint32_t>();
+    if (i >= objects.size()) {
+      corrupt();
+    }
+    return objects[i];
+  }
+  const Scope &scope(std::uint32_t i) {
+    if (i >= scopes.size()) {
+      corrupt();
+    }
+    return *scopes[i];
+  }
+  template <typename T> std::vector<T> get_array() {
+    std::string_view bytes = get_bytes();
+    if (bytes.size() % sizeof(T) != 0) {
+      corrupt();
+    }
+    std::vector<T> values(bytes.size() / sizeof(T));
+    std::memcpy(values.data(), bytes.data(), bytes.size());
+    return values;
+  }
+  void add(SExp *obj) { objects.push_back(env.manage(obj)); }
+  void read_builtin() {
+    const std::string &id = name();
+    SExp *value = env.lookup(id);
+    if (!value) {
+      throw io_error("Image " + path + " refers to " + id +
+                     ", which isn't a builtin");
+    }
+    objects.push_back(value);
+  }
+  void read_lambda() {
+    std::list<std::string> params;
+    for (std::uint32_t n = get<std::uint32_t>(); n > 0; --n) {
+      params.push_back(name());
+    }
+    std::list<SExp *> body;
+    for (std::uint32_t n = get<std::uint32_t>(); n > 0; --n) {
+      body.push_back(object());
+    }
+    std::uint32_t i = get<std::uint32_t>();
+    if (i >= scopes.size()) {
+      corrupt();
+    }
+    LambdaFunction *lambda;
+    if (unclaimed[i]) {
+      lambda = new LambdaFunction(Env(env, std::move(*unclaimed[i])),
+                                  std::move(params), std::move(body));
+      unclaimed[i].reset();
+      scopes[i] = &lambda->closure.scope;
+    } else {
+      lambda = new LambdaFunction(Env(env, *scopes[i]), std::move(params),
+                                  std::move(body));
+    }
+    add(lambda);
+  }
+  // each string must end within the characters, after the one before it
+  void read_string_vector() {
+    auto chars = std::make_shared<const std::string>(get_bytes());
+    std::vector<std::size_t> ends = get_array<std::size_t>();
+    for (std::size_t i = 0; i < ends.size(); ++i) {
+      if (ends[i] > chars->size() || (i > 0 && ends[i] < ends[i - 1])) {
+        corrupt();
+      }
+    }
+    add(new StringVector(std::move(chars), std::move(ends)));
+  }
+  void read_scope() {
+    std::uint32_t base = get<std::uint32_t>();
+    Scope s = base == no_base ? Scope() : scope(base);
+    for (std::uint32_t n = get<std::uint32_t>(); n > 0; --n) {
+      s.erase(name());
+    }
+    for (std::uint32_t n = get<std::uint32_t>(); n > 0; --n) {
+      const std::string &id = name();
+      s[id] = object();
+    }
+    unclaimed.push_back(std::make_unique<Scope>(std::move(s)));
+    scopes.push_back(unclaimed.back().get());
+  }
+
+public:
+  ImageReader(GlobalEnv &env, const std::string &path, const char *begin,
+              const char *end)
+      : env(env), path(path), pos(begin), end(end) {}
+  void read() {
+    if (std::size_t(end - pos) < sizeof(magic) ||
+        std::memcmp(pos, magic, sizeof(magic)) != 0) {
+      throw io_error(path + " isn't an image");
+    }
+    pos += sizeof(magic);
+    while (true) {
+      switch (static_cast<Record>(get<std::uint8_t>())) {
+      case Record::name:
+        names.emplace_back(get_bytes());
+        break;
+      case Record::number:
+        add(new Number(get<double>()));
+        break;
+      case Record::string:
+        add(new String(std::string(get_bytes())));
+        break;
+      case Record::boolean:
+        add(new Bool(get<std::uint8_t>() != 0));
+        break;
+      case Record::atom:
+        add(new Atom(name()));
+        break;
+      case Record::list: {
+        std::list<SExp *> elems;
+        for (std::uint32_t n = get<std::uint32_t>(); n > 0; --n) {
+          elems.push_back(object());
+        }
+        add(new List(std::move(elems)));
+        break;
+      }
+      case Record::builtin:
+        read_builtin();
+        break;
+      case Record::lambda:
+        read_lambda();
+        break;
+      case Record::scope:
+        read_scope();
+        break;
+      case Record::bytevector:
+        add(new Bytevector(get_array<std::uint8_t>()));
+        break;
+      case Record::number_vector:
+        add(new NumberVector(get_array<double>()));
+        break;
+      case Record::string_vector:
+        read_string_vector();
+        break;
+      case Record::globals: {
+        const Scope &globals = scope(get<std::uint32_t>());
+        if (pos != end) {
+          corrupt();
+        }
+        for (auto it = globals.begin(); it != globals.end(); ++it) {
+          env.def(it->first, it->second);
+        }
+        return;
+      }
+      default:
+        corrupt();
+      }
+    }
+  }
+};
+
+void load_image(GlobalEnv &env, const std::string &path) {
+  MappedFile file(path);
+  ImageReader(env, path, file.begin(), file.end()).read();
+}
@@ -0,0 +1,37 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <string>
+
+class GlobalEnv;
+
+/*
+A heap image is a snapshot of an interpreter's global definitions, and
+everything they refer to, saved to a file so that another interpreter can
+start from it rather than evaluating the same prelude again.
+
+Objects can't be written out as they are in memory, since they are full of
+pointers, so the image is a stream of records, one per object, each of
+which refers to others by their position in the stream. Every object comes
+after those it refers to, so loading maps the file and makes each object
+in a single pass, turning positions into pointers as it goes. Shared
+values are written once, and are still shared when they are loaded.
+
+Most of an image is the scopes closed over by lambdas: every top level
+lambda closes over the whole global scope as it was when it was made, so
+each one's scope is written as the changes from a similar scope written
+before it.
+
+The builtins aren't written out. The interpreter loading an image has its
+own, so primitive functions are bound again by name, as are standard input
+and output and eof. Other ports, futures, channels and coroutines belong to
+the running process, and can't be saved.
+*/
+
+// write everything defined in env to an image at path
+void save_image(GlobalEnv &env, const std::string &path);
+// define everything in the image at path in env, throwing io_error if the
+// file isn't an image, or evaluation_error if it doesn't fit in env's heap
+void load_image(GlobalEnv &env, const std::string &path);
+
+#endif
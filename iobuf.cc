@@ -0,0 +1,419 @@
+#include "iobuf.h"
+#include "coroutine.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string &name) : data(nullptr), size(0) {
+  int fd = ::open(name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw io_error("Cannot open file " + name);
+  }
+  struct stat info;
+  if (::fstat(fd, &info) < 0) {
+    ::close(fd);
+    throw io_error("Cannot read file " + name);
+  }
+  size = info.st_size;
+  // mmap refuses to map nothing, so an empty file is left as a null range
+  if (size > 0) {
+    void *mem = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mem == MAP_FAILED) {
+      ::close(fd);
+      throw io_error("Cannot map file " + name);
+    }
+    // the file is lexed from start to finish
+    ::madvise(mem, size, MADV_SEQUENTIAL);
+    data = static_cast<const char *>(mem);
+  }
+  // the mapping stays valid after the descriptor is closed
+  ::close(fd);
+}
+
+long long file_size(const std::string &name) {
+  struct stat info;
+  if (::stat(name.c_str(), &info) < 0) {
+    return -1;
+  }
+  return info.st_size;
+}
+
+MappedFile::~MappedFile() {
+  if (data) {
+    ::munmap(const_cast<char *>(data), size);
+  }
+}
+
+InputBuffer::InputBuffer(const std::string &name)
+    : fd(::open(name.c_str(), O_RDONLY)), owned(true), block(block_size) {
+  if (fd < 0) {
+    throw io_error("Cannot open file " + name);
+  }
+  setg(block.data(), block.data(), block.data());
+}
+
+InputBuffer::InputBuffer(int fd, bool owned)
+    : fd(fd), owned(owned), block(block_size) {
+  setg(block.data(), block.data(), block.data());
+}
+
+// the text is the only block there is
+InputBuffer::InputBuffer(const char *begin, const char *end)
+    : fd(-1), owned(false), block(begin, end) {
+  setg(block.data(), block.data(), block.data() + block.size());
+}
+
+InputBuffer::int_type InputBuffer::underflow() {
+  if (gptr() < egptr()) {
+    return traits_type::to_int_type(*gptr());
+  }
+  if (fd < 0) {
+    return traits_type::eof();
+  }
+  ssize_t n;
+  while ((n = ::read(fd, block.data(), block.size())) < 0) {
+    if (errno == EAGAIN) {
+      Scheduler::wait_for(fd, false);
+    } else if (errno != EINTR) {
+      break;
+    }
+  }
+  if (n <= 0) {
+    return traits_type::eof();
+  }
+  setg(block.data(), block.data(), block.data() + n);
+  return traits_type::to_int_type(*gptr());
+}
+
+// whatever is already in the block is used first, then anything as big as a
+// block is read from the file directly
+std::streamsize InputBuffer::xsgetn(char *dest, std::streamsize count) {
+  std::streamsize done = std::min<std::streamsize>(count, egptr() - gptr());
+  std::memcpy(dest, gptr(), done);
+  setg(eback(), gptr() + done, egptr());
+  while (done < count && count - done >= std::streamsize(block.size()) &&
+         fd >= 0) {
+    ssize_t n = ::read(fd, dest + done, count - done);
+    if (n < 0 && errno == EAGAIN) {
+      Scheduler::wait_for(fd, false);
+      continue;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      return done;
+    }
+    done += n;
+  }
+  while (done < count &&
+         !traits_type::eq_int_type(underflow(), traits_type::eof())) {
+    std::streamsize chunk =
+        std::min<std::streamsize>(count - done, egptr() - gptr());
+    std::memcpy(dest + done, gptr(), chunk);
+    setg(eback(), gptr() + chunk, egptr());
+    done += chunk;
+  }
+  return done;
+}
+
+std::size_t InputBuffer::read_at(char *dest, std::size_t count,
+                                 std::size_t offset) {
+  if (fd < 0) {
+    // the buffer holds the whole of a string
+    if (offset >= block.size()) {
+      return 0;
+    }
+    count = std::min(count, block.size() - offset);
+    std::memcpy(dest, block.data() + offset, count);
+    return count;
+  }
+  std::size_t done = 0;
+  while (done < count) {
+    ssize_t n = ::pread(fd, dest + done, count - done, offset + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      throw io_error("Error reading file");
+    } else if (n == 0) {
+      break;
+    }
+    done += n;
+  }
+  return done;
+}
+
+bool InputBuffer::read_line(std::string &line) {
+  line.clear();
+  bool found = false;
+  while (!traits_type::eq_int_type(underflow(), traits_type::eof())) {
+    found = true;
+    char *next = gptr();
+    auto newline =
+        static_cast<char *>(std::memchr(next, '\n', egptr() - next));
+    if (newline) {
+      line.append(next, newline);
+      setg(eback(), newline + 1, egptr());
+      return true;
+    }
+    line.append(next, egptr());
+    setg(eback(), egptr(), egptr());
+  }
+  return found;
+}
+
+void InputBuffer::read_all(std::string &str) {
+  while (!traits_type::eq_int_type(underflow(), traits_type::eof())) {
+    str.append(gptr(), egptr());
+    setg(eback(), egptr(), egptr());
+  }
+}
+
+bool InputBuffer::ready() {
+  if (gptr() < egptr() || fd < 0) {
+    return true;
+  }
+  struct pollfd p;
+  p.fd = fd;
+  p.events = POLLIN;
+  return ::poll(&p, 1, 0) > 0;
+}
+
+void InputBuffer::close() {
+  if (fd >= 0 && owned) {
+    ::close(fd);
+  }
+  fd = -1;
+  setg(block.data(), block.data(), block.data());
+}
+
+OutputBuffer::OutputBuffer(const std::string &name)
+    : fd(::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666)),
+      socket(false), block(block_size) {
+  if (fd < 0) {
+    throw io_error("Cannot open file " + name);
+  }
+  setp(block.data(), block.data() + block.size());
+}
+
+OutputBuffer::OutputBuffer(int fd, bool socket)
+    : fd(fd), socket(socket), block(block_size) {
+  setp(block.data(), block.data() + block.size());
+}
+
+bool OutputBuffer::drain() {
+  const char *next = pbase();
+  while (next < pptr()) {
+    ssize_t n = ::write(fd, next, pptr() - next);
+    if (n < 0 && errno == EAGAIN) {
+      Scheduler::wait_for(fd, true);
+      continue;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      return false;
+    }
+    next += n;
+  }
+  setp(block.data(), block.data() + block.size());
+  return true;
+}
+
+OutputBuffer::int_type OutputBuffer::overflow(int_type c) {
+  if (fd < 0 || !drain()) {
+    return traits_type::eof();
+  }
+  if (!traits_type::eq_int_type(c, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+  }
+  return traits_type::not_eof(c);
+}
+
+std::streamsize OutputBuffer::xsputn(const char *src, std::streamsize count) {
+  if (count < epptr() - pptr()) {
+    std::memcpy(pptr(), src, count);
+    pbump(count);
+    return count;
+  }
+  if (fd < 0 || !drain()) {
+    return 0;
+  }
+  if (count < std::streamsize(block.size())) {
+    std::memcpy(pptr(), src, count);
+    pbump(count);
+    return count;
+  }
+  std::streamsize done = 0;
+  while (done < count) {
+    ssize_t n = ::write(fd, src + done, count - done);
+    if (n < 0 && errno == EAGAIN) {
+      Scheduler::wait_for(fd, true);
+      continue;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  return done;
+}
+
+int OutputBuffer::sync() { return fd >= 0 && drain() ? 0 : -1; }
+
+// a socket's input port has its own copy of the descriptor, so the socket
+// is shut down for writing to let the other end see the end of its input
+void OutputBuffer::close() {
+  if (fd >= 0) {
+    drain();
+    if (socket) {
+      ::shutdown(fd, SHUT_WR);
+    }
+    ::close(fd);
+    fd = -1;
+  }
+}
+
+// the descriptors are set not to block, so reads and writes which would
+// wait go through Scheduler::wait_for instead
+static int nonblocking(int fd) {
+  int flags = ::fcntl(fd, F_GETFL);
+  ::fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  return fd;
+}
+
+PortFds open_pipe() {
+  int fds[2];
+  if (::pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+    throw io_error("Cannot open pipe: " + std::string(std::strerror(errno)));
+  }
+  return PortFds{fds[0], fds[1], false};
+}
+
+// the output side of each end is a duplicate, so the ports can be closed
+// separately
+static PortFds socket_ports(int fd) {
+  int out = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (out < 0) {
+    ::close(fd);
+    throw io_error("Cannot open socket: " + std::string(std::strerror(errno)));
+  }
+  return PortFds{fd, out, true};
+}
+
+std::pair<PortFds, PortFds> open_socket_pair() {
+  int fds[2];
+  if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                   fds) < 0) {
+    throw io_error("Cannot open socket pair: " +
+                   std::string(std::strerror(errno)));
+  }
+  PortFds first = socket_ports(fds[0]);
+  try {
+    return std::make_pair(first, socket_ports(fds[1]));
+  } catch (const io_error &) {
+    ::close(first.in);
+    ::close(first.out);
+    throw;
+  }
+}
+
+static bool socket_address(const std::string &path,
+                           struct sockaddr_un &address) {
+  if (path.size() >= sizeof(address.sun_path)) {
+    return false;
+  }
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  return true;
+}
+
+// connecting to a local socket doesn't wait for the other end to accept,
+// so it is done before the socket is made non-blocking
+PortFds connect_socket(const std::string &path) {
+  struct sockaddr_un address;
+  if (!socket_address(path, address)) {
+    throw io_error("Socket path too long: " + path);
+  }
+  int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    throw io_error("Cannot open socket: " + std::string(std::strerror(errno)));
+  }
+  if (::connect(fd, reinterpret_cast<struct sockaddr *>(&address),
+                sizeof(address)) < 0) {
+    ::close(fd);
+    throw io_error("Cannot connect to socket " + path);
+  }
+  return socket_ports(nonblocking(fd));
+}
+
+// only a stale socket is removed, never some other kind of file
+int listen_socket(const std::string &path) {
+  struct sockaddr_un address;
+  if (!socket_address(path, address)) {
+    throw io_error("Socket path too long: " + path);
+  }
+  struct stat info;
+  if (::stat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+    ::unlink(path.c_str());
+  }
+  int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    throw io_error("Cannot open socket: " + std::string(std::strerror(errno)));
+  }
+  if (::bind(fd, reinterpret_cast<struct sockaddr *>(&address),
+             sizeof(address)) < 0 ||
+      ::listen(fd, SOMAXCONN) < 0) {
+    std::string reason = std::strerror(errno);
+    ::close(fd);
+    throw io_error("Cannot listen on socket " + path + ": " + reason);
+  }
+  return fd;
+}
+
+int accept_connection(int listener) {
+  int fd;
+  while ((fd = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC)) < 0) {
+    if (errno != EINTR && errno != ECONNABORTED) {
+      throw io_error("Cannot accept connection: " +
+                     std::string(std::strerror(errno)));
+    }
+  }
+  return fd;
+}
+
+std::string read_connection(int fd, std::chrono::milliseconds timeout) {
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  std::string text;
+  std::vector<char> block(1 << 16);
+  while (true) {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now());
+    struct pollfd p;
+    p.fd = fd;
+    p.events = POLLIN;
+    int ready = left.count() > 0 ? ::poll(&p, 1, left.count()) : 0;
+    if (ready < 0 && errno == EINTR) {
+      continue;
+    } else if (ready == 0) {
+      throw io_error("Timed out reading request");
+    }
+    ssize_t n = ready < 0 ? -1 : ::read(fd, block.data(), block.size());
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      throw io_error("Cannot read request: " +
+                     std::string(std::strerror(errno)));
+    } else if (n == 0) {
+      return text;
+    }
+    text.append(block.data(), n);
+  }
+}
@@ -0,0 +1,143 @@
+#ifndef IOBUF_H
+#define IOBUF_H
+
+#include "lisp_exceptions.h"
+#include <chrono>
+#include <cstddef>
+#include <streambuf>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+Low level buffers for getting data in and out of the interpreter without
+going through the iostream machinery a character at a time.
+
+A MappedFile maps the whole of a file into memory read only, so that it
+can be lexed in place without being copied.
+
+An InputBuffer reads from a file descriptor in large blocks. It is a
+streambuf, so the parser can read from it like any other stream, but it
+can also hand out whole lines by searching the block it has read for
+newlines, which is much faster than reading a character at a time.
+
+An OutputBuffer collects everything written to it in a large block, and
+only writes to its file descriptor when the block fills up or it is
+flushed, so printing doesn't make a system call per expression.
+
+Both work with descriptors which don't block, like the pipes and sockets
+opened here: whenever one would have to wait, it goes through
+Scheduler::wait_for, which lets other coroutines run in the meantime.
+*/
+
+class MappedFile {
+private:
+  const char *data;
+  std::size_t size;
+
+public:
+  // throws an io_error if the file can't be opened
+  MappedFile(const std::string &name);
+  const char *begin() const { return data; }
+  const char *end() const { return data + size; }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  ~MappedFile();
+};
+
+// the size of the file name in bytes, or -1 if it can't be found
+long long file_size(const std::string &name);
+
+class InputBuffer : public std::streambuf {
+private:
+  int fd;     // -1 once closed
+  bool owned; // whether closing the buffer closes fd
+  std::vector<char> block;
+
+protected:
+  int_type underflow() override;
+  // large reads go straight into the destination, not through the block
+  std::streamsize xsgetn(char *dest, std::streamsize count) override;
+
+public:
+  static const std::size_t block_size = 1 << 18;
+
+  // open the file name for reading, throwing an io_error if it can't be
+  InputBuffer(const std::string &name);
+  // read from an already open descriptor, like standard input
+  InputBuffer(int fd, bool owned);
+  // read a copy of the characters in [begin, end)
+  InputBuffer(const char *begin, const char *end);
+  // read up to the next newline into line, without the newline. Returns
+  // false if there was nothing left to read
+  bool read_line(std::string &line);
+  // append everything left to str
+  void read_all(std::string &str);
+  // whether a read would return straight away, rather than wait for input
+  bool ready();
+  // read up to count bytes starting at offset in the file into dest,
+  // without moving the position reads carry on from. Returns the number of
+  // bytes read, which is less than count at the end of the file
+  std::size_t read_at(char *dest, std::size_t count, std::size_t offset);
+  bool is_open() const { return fd >= 0; }
+  void close();
+  InputBuffer(const InputBuffer &) = delete;
+  InputBuffer &operator=(const InputBuffer &) = delete;
+  ~InputBuffer() { close(); }
+};
+
+class OutputBuffer : public std::streambuf {
+private:
+  int fd; // -1 once closed
+  bool socket; // whether to shut fd down for writing when closing it
+  std::vector<char> block;
+  // write out everything in the block, returning false on failure
+  bool drain();
+
+protected:
+  int_type overflow(int_type c) override;
+  int sync() override;
+  // large writes go straight to the file, not through the block
+  std::streamsize xsputn(const char *src, std::streamsize count) override;
+
+public:
+  static const std::size_t block_size = 1 << 18;
+
+  // create or truncate the file name, throwing an io_error if it can't be
+  OutputBuffer(const std::string &name);
+  // write to an open descriptor, which is closed along with the buffer. A
+  // socket is shut down for writing first, so the other end sees the end of
+  // its input even while another descriptor for it is open
+  OutputBuffer(int fd, bool socket = false);
+  bool is_open() const { return fd >= 0; }
+  // flush and close the file
+  void close();
+  OutputBuffer(const OutputBuffer &) = delete;
+  OutputBuffer &operator=(const OutputBuffer &) = delete;
+  ~OutputBuffer() { close(); }
+};
+
+// the descriptors for the input and output ports of a connection
+struct PortFds {
+  int in;
+  int out;
+  bool socket; // whether they are both the same socket
+};
+
+// Descriptors which don't block. Each throws an io_error if they can't be
+// opened
+PortFds open_pipe();
+// both ends of a connected pair of local sockets
+std::pair<PortFds, PortFds> open_socket_pair();
+// a connection to the Unix domain socket at path
+PortFds connect_socket(const std::string &path);
+// a Unix domain socket listening at path, replacing any socket already
+// there. Unlike the others, it and the connections it accepts block
+int listen_socket(const std::string &path);
+// wait for the next connection to listener
+int accept_connection(int listener);
+// read everything sent on the connection fd until the other end stops
+// sending, throwing io_error if that takes longer than timeout
+std::string read_connection(int fd, std::chrono::milliseconds timeout);
+
+#endif
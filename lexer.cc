@@ -1,12 +1,76 @@
 #include "lexer.h"
+#include <algorithm>
+#include <charconv>
+#include <cstdlib>
 
 const char newline('\n'); // platform dependent
 
-Token Lexer::get_token() {
+Lexer::Lexer(const char *begin, const char *end)
+    : start(begin), pos(begin), end(end), token(begin), stream(nullptr),
+      parsed_num(0), lines_discarded(0) {}
+
+Lexer::Lexer(std::istream &stream)
+    : stream(&stream), parsed_num(0), lines_discarded(0) {
+  start = pos = end = token = buffer.data();
+}
+
+// read another line from the stream into the buffer, returning false if
+// there is no more input. The lines before the one the current token
+// started on are no longer needed, so they are dropped
+bool Lexer::refill() {
+  std::string line;
+  if (!stream || !std::getline(*stream, line)) {
+    return false;
+  }
+  if (!stream->eof()) {
+    line.push_back(newline);
+  }
+  std::size_t keep = token - start;
+  std::size_t line_start = std::string_view(buffer.data(), keep).rfind(newline);
+  line_start = line_start == std::string_view::npos ? 0 : line_start + 1;
+  lines_discarded +=
+      std::count(buffer.begin(), buffer.begin() + line_start, newline);
+  std::size_t offset = pos - start;
+  buffer.erase(0, line_start);
+  buffer += line;
+  start = buffer.data();
+  end = start + buffer.size();
+  pos = start + offset - line_start;
+  token = start + keep - line_start;
+  return true;
+}
+
+void Lexer::discard_buffered() {
+  lines_discarded += std::count(buffer.begin(), buffer.end(), newline);
+  buffer.clear();
+  if (stream) {
+    start = pos = end = token = buffer.data();
+  }
+}
+
+// the line number and position of the last character lexed are counted
+// from the buffer on demand, since they are only needed for errors
+int Lexer::get_linenum() {
+  return 1 + lines_discarded + std::count(start, pos, newline);
+}
 
+int Lexer::get_linepos() {
+  const char *line = pos;
+  while (line != start && line[-1] != newline) {
+    --line;
+  }
+  return pos - line;
+}
+
+Token Lexer::get_token() {
+  // nothing before here is needed any more
+  token = pos;
   consume_spaces();
-  auto c = stream.get();
-  linepos++;
+  auto c = peek();
+  if (c == EOF) {
+    return Token::eof;
+  }
+  token = pos++;
   if (c == '(') {
     return Token::open_bracket;
   } else if (c == ')') {
@@ -14,15 +78,13 @@ Token Lexer::get_token() {
   } else if (c == '\'') {
     return Token::kw_quote;
   } else if (isdigit(c) || c == '-' || c == '.') {
-    return lisp_number(c);
+    return lisp_number();
   } else if (is_lisp_symbol(c)) {
-    return lisp_atom(c);
+    return lisp_atom();
   } else if (c == '\"') {
-    return lisp_string(c);
+    return lisp_string();
   } else if (c == '#') {
-    return lisp_bool(c);
-  } else if (c == EOF) {
-    return Token::eof;
+    return lisp_bool();
   } else if (c == ';') {
     consume_comment();
     return get_token();
@@ -30,144 +92,147 @@ Token Lexer::get_token() {
   // debugging assertion
   throw implementation_error("Non-irrefutable logic pattern in lexer");
 }
-// ignore whitespace characters, keeping track of the internal line number
-// counter.
+// ignore whitespace characters
 void Lexer::consume_spaces() {
-  char c = stream.get();
-  linepos++;
-  while (std::isspace(c)) {
-    if (c == newline) {
-      ++linenum;
-      linepos=1;
-    }
-    c = stream.get();
-    linepos++;
+  while (std::isspace(peek())) {
+    ++pos;
   }
-  
-  stream.putback(c);
-  linepos--;
-  return;
 }
 // called when the comment character ; is encountered: ignore everything until a
 // newline
 void Lexer::consume_comment() {
-  for (char c = stream.get(); c != newline; c = stream.get()) {
-  	if (c == EOF) { 
-  		stream.putback(c);
-  		linepos--;
-  		break;
-  	}
-  }
-  linenum++;
-  linepos = 1;
-  return;
+  for (int c = peek(); c != newline && c != EOF; c = peek()) {
+    ++pos;
+  }
 }
-Token Lexer::lisp_number(char c) {
-  auto buf = std::stringstream("");
-  //- is allowed in numbers, but only as the first character
-  if (c == '-') {
-    buf.put(c);
-    c = stream.get();
-    linepos++;
+// the length of the numeric literal at the start of text, or 0 if it
+// doesn't start with one. Numbers look like -12.5e-3: the sign, fraction
+// and exponent are all optional, but there must be some digits before the
+// exponent
+static std::size_t number_length(std::string_view text) {
+  std::size_t i = 0, digits = 0;
+  auto scan_digits = [&text, &i]() -> std::size_t {
+    std::size_t from = i;
+    while (i < text.size() && isdigit(static_cast<unsigned char>(text[i]))) {
+      ++i;
+    }
+    return i - from;
+  };
+  if (i < text.size() && text[i] == '-') {
+    ++i;
   }
-
-  for (; isdigit(c); c = stream.get()) {
-  	linepos++;
-    if (c == EOF) {
-      throw parser_error("Reached unexpected end-of-file "
-                                  "while parsing numeric literal");
+  digits += scan_digits();
+  if (i < text.size() && text[i] == '.') {
+    ++i;
+    digits += scan_digits();
+  }
+  if (digits == 0) {
+    return 0;
+  }
+  if (i < text.size() && (text[i] == 'e' || text[i] == 'E')) {
+    std::size_t mantissa = i++;
+    if (i < text.size() && (text[i] == '-' || text[i] == '+')) {
+      ++i;
     }
-    buf.put(c);
-  }
-  if (c == '.') {
-    buf.put('.');
-    for (c = stream.get(); isdigit(c); c = stream.get()) {
-      linepos++;
-      if (c == EOF) {
-        throw parser_error("Reached unexpected "
-                                    "end-of-file while parsing "
-                                    "numeric literal");
-      }
-      buf.put(c);
+    if (scan_digits() == 0) {
+      return mantissa;
     }
   }
-  if (!(is_delim(c) || c == ')') || buf.str() == "-") {
-    // the scheme like behaviour is to accept everything that is not
-    // a number as a valid atom (even weird stuff like 3.23214123a
-    // is a valid name)
-    // to get this behaviour, we just reset the scope of the stream
-    // by unloading the buffer, then call list_atom
-    buf.put(c);
-    std::string atom = buf.str();
-    for (auto it = atom.rbegin(); it != atom.rend(); ++it) {
-      stream.putback(*it);
-      linepos--;
-    }
-    return lisp_atom(stream.get());
+  return i;
+}
+
+Token Lexer::lisp_number() {
+  // take the whole run of characters that could be in an atom, then decide
+  // which it is: the scheme like behaviour is to accept everything that is
+  // not a number as a valid atom (even weird stuff like 3.23214123a is a
+  // valid name)
+  lisp_atom();
+  std::string_view text = parsed_str;
+  int c = peek();
+  if (number_length(text) != text.size() || !(is_delim(c) || c == ')')) {
+    return Token::atom;
+  }
+  // from_chars doesn't depend on the locale, and converts exactly
+  auto result = std::from_chars(text.data(), text.data() + text.size(),
+                                parsed_num);
+  if (result.ec == std::errc::result_out_of_range) {
+    // from_chars leaves the result alone if it over or underflows: strtod
+    // gives infinity or zero
+    parsed_num = std::strtod(std::string(text).c_str(), nullptr);
   }
-  stream.putback(c);
-  linepos--;
-  buf >> parsed_num;
   return Token::num;
 }
-Token Lexer::lisp_string(char c) {
-
-  auto buf = std::stringstream("");
-  for (c = stream.get(); c != '\"'; c = stream.get()) {
-	linepos++;
+// String literals are views into the buffer unless they contain escape
+// sequences, in which case their value is built up in escaped
+Token Lexer::lisp_string() {
+  bool escapes = false;
+  int c;
+  for (c = peek(); c != '\"'; c = peek()) {
+    if (c == EOF) {
+      throw parser_error("Reached unexpected "
+                                  "end-of-file: expected "
+                                  "closing \"");
+    }
+    ++pos;
     if (c == '\\') {
+      if (!escapes) {
+        escaped.assign(token + 1, pos - 1);
+        escapes = true;
+      }
       // allow escaped special characters, like ", \n, etc
-      char esc = stream.get();
+      int esc = peek();
+      if (esc != EOF) {
+        ++pos;
+      }
       switch (esc) {
       case '\"':
-        buf.put(esc);
+        escaped.push_back(esc);
         break;
       case 'n':
-        buf.put('\n');
+        escaped.push_back('\n');
         break;
       case 't':
-        buf.put('\t');
+        escaped.push_back('\t');
         break;
       case '\'':
-        buf.put(esc);
+        escaped.push_back(esc);
         break;
       case '\\':
-        buf.put('\\');
+        escaped.push_back('\\');
         break;
       default:
         throw parser_error("Unrecognised escape sequence in parser");
       }
       continue;
     }
-    if (c == EOF) {
-      throw parser_error("Reached unexpected "
-                                  "end-of-file: expected "
-                                  "closing \"");
+    if (escapes) {
+      escaped.push_back(c);
     }
-    buf.put(c);
   }
   // don't putback- consume second "
-  parsed_str = buf.str();
+  ++pos;
+  if (escapes) {
+    parsed_str = escaped;
+  } else {
+    parsed_str = std::string_view(token + 1, pos - token - 2);
+  }
   return Token::string;
 }
-Token Lexer::lisp_atom(char c) {
-  auto buf = std::stringstream("");
-  for (; is_lisp_symbol(c) || isdigit(c) || c == '.'; c = stream.get()) {
-  	linepos++;
-    buf.put(c);
-  }
-  stream.putback(c);
-  linepos--;
-  std::string str = buf.str();
-  parsed_str = str;
+Token Lexer::lisp_atom() {
+  for (int c = peek(); is_lisp_symbol(c) || isdigit(c) || c == '.';
+       c = peek()) {
+    ++pos;
+  }
+  parsed_str = std::string_view(token, pos - token);
   return Token::atom;
 }
-Token Lexer::lisp_bool(char c) {
-  int b = stream.get();
-  linepos++;
-  
-  char peek = stream.peek();
-  if (!(is_delim(peek) || peek == ')')) {
+Token Lexer::lisp_bool() {
+  int b = peek();
+  if (b != EOF) {
+    ++pos;
+  }
+  int next = peek();
+  if (!(is_delim(next) || next == ')')) {
     throw parser_error(
                        "Unexpected character following #: expected t or f");
   }
@@ -182,7 +247,7 @@ Token Lexer::lisp_bool(char c) {
   }
 }
 // valid components of lisp atoms
-bool Lexer::is_lisp_symbol(char c) {
+bool Lexer::is_lisp_symbol(int c) {
   // this is a little bit dumb
   return (isalpha(c) || c == '!' || c == '$' || c == '%' || c == '&' ||
           c == '|' || c == '*' || c == '+' || c == '-' || c == '/' ||
@@ -190,4 +255,4 @@ bool Lexer::is_lisp_symbol(char c) {
           c == '@' || c == '^' || c == '_' || c == '~');
 }
 // valid delimeters
-bool Lexer::is_delim(char c) { return (std::isspace(c) || c == EOF); }
+bool Lexer::is_delim(int c) { return (std::isspace(c) || c == EOF); }
@@ -4,8 +4,8 @@
 #include "lisp_exceptions.h"
 #include <cctype>
 #include <iostream>
-#include <sstream>
 #include <string>
+#include <string_view>
 
 /*
 The lexer transforms a stream of characters into a sequence of tokens,
@@ -16,9 +16,18 @@ as a number or a string, this is stored in the lexer, and must
 be retrieved from it using the accessor functions by the parser
 when it encounters a appropriate symbol.
 
-The lexer tracks the current line and position in the file it's
-reading, which is used to provide more helpful error reporting. It's
-only approximatly accurate for non-parser errors. 
+The lexer scans a contiguous buffer of characters with a pointer. It can
+either be given the whole input at once (for example a memory mapped
+script), in which case the text of atoms and strings are views straight
+into it, or it can read from a stream, which it does a line at a time as
+it runs out of input. Lines that have been completely lexed are thrown
+away, so a stream of any length can be lexed in the memory of its longest
+expression.
+
+The line and position in the input are only worked out when asked for,
+by counting back through the buffer, which is used to provide more
+helpful error reporting. It's only approximatly accurate for non-parser
+errors.
 */
 
 
@@ -41,32 +50,53 @@ enum class Token {
 
 class Lexer {
 public:
-  std::istream &stream;
-  std::string parsed_str;
-  double parsed_num;
-  
-  Lexer(std::istream &stream) : stream(stream), linenum(1), linepos(1) {}
-  
-  //return the last string or numeric literal parsed by the lexer
-  std::string get_parsed_str() { return parsed_str; }
+  // lex the characters in [begin, end), which must outlive the lexer
+  Lexer(const char *begin, const char *end);
+  // lex the characters read from stream
+  Lexer(std::istream &stream);
+  Lexer(const Lexer &) = delete;
+  Lexer &operator=(const Lexer &) = delete;
+
+  //return the last string or numeric literal parsed by the lexer. The
+  //string is only valid until the next token is read
+  std::string_view get_parsed_str() { return parsed_str; }
   double get_parsed_num() { return parsed_num; }
-  int get_linenum() { return linenum; }
-  int get_linepos() { return linepos; }
-  
+  int get_linenum();
+  int get_linepos();
+
   //return the next token from the stream the lexer is processing
   Token get_token();
+  //forget any input read from the stream but not yet lexed
+  void discard_buffered();
 
 private:
-  int linenum; //current line number of the stream
-  int linepos; //current position in the line 
+  const char *start; // beginning of the buffer
+  const char *pos;   // next character to lex
+  const char *end;   // end of the buffer
+  const char *token; // start of the token being lexed
+  std::istream *stream; // where more input comes from, if anywhere
+  std::string buffer;   // holds the lines read from the stream
+  std::string escaped;  // the value of a string literal with escapes in it
+  std::string_view parsed_str;
+  double parsed_num;
+  int lines_discarded; // number of lines thrown away from the buffer
+
+  bool refill();
+  // look at the next character without consuming it, or EOF
+  int peek() {
+    if (pos == end && !refill()) {
+      return EOF;
+    }
+    return static_cast<unsigned char>(*pos);
+  }
   void consume_comment();
   void consume_spaces();
-  Token lisp_number(char c);
-  Token lisp_string(char c);
-  Token lisp_atom(char c);
-  Token lisp_bool(char c);
-  bool is_lisp_symbol(char c);
-  bool is_delim(char c);
+  Token lisp_number();
+  Token lisp_string();
+  Token lisp_atom();
+  Token lisp_bool();
+  bool is_lisp_symbol(int c);
+  bool is_delim(int c);
 };
 
-#endif
\ No newline at end of file
+#endif
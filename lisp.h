@@ -0,0 +1,164 @@
+#ifndef LISP_H
+#define LISP_H
+
+#include "budget.h"
+#include "lisp_exceptions.h"
+#include <cstddef>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+class SExp;
+class Env;
+class GlobalEnv;
+
+/*
+The embedding interface, for running lisp inside another C++ program. It is
+built into liblisp.a. A program using it needs this header and the two it
+includes: budget.h, for the Limits an evaluation runs under, and
+lisp_exceptions.h, for the errors it throws. The interpreter's own classes
+are only declared here, not defined.
+
+An Interpreter is a GlobalEnv with the builtins bound, like the one a script
+runs in. Source text can be evaluated straight away, or compiled once into a
+Program and evaluated as often as needed without being parsed again. A
+Program's code is kept until the interpreter is destroyed, even once the
+Program is gone, so compile is for source which is run repeatedly: source
+text passed to eval is parsed into the heap, and collected like any other
+value once nothing refers to it. Global
+functions can be looked up and called with C++ numbers, strings and bools,
+which are converted on the way in. Calling a lisp function from C++ binds
+the arguments straight to its parameters, without building an expression
+for each call (see Function::apply). C++ functions can be bound as globals,
+and called from lisp like any builtin.
+
+Values are pointers into the interpreter's heap, so they are cheap to copy,
+but the collector doesn't know about the ones C++ holds. A value stays valid
+until the next collection, which only happens when eval moves on from one
+top level form to the next, or when collect_garbage is called. To keep a
+value for longer, define it as a global. Errors are thrown as the
+exceptions in lisp_exceptions.h, and leave the interpreter usable.
+
+An interpreter, and its values, belong to one thread at a time, though
+different interpreters can be used on different threads at once.
+*/
+
+namespace lisp {
+
+class Value {
+private:
+  SExp *exp;
+
+public:
+  Value() : exp(nullptr) {}
+  explicit Value(SExp *exp) : exp(exp) {}
+  SExp *sexp() const { return exp; }
+  bool is_number() const;
+  bool is_string() const;
+  bool is_boolean() const;
+  bool is_list() const;
+  bool is_function() const;
+  // the C++ value: these throw evaluation_error if it is of another type
+  double number() const;
+  std::string string() const;
+  bool boolean() const;
+  std::vector<Value> elements() const;
+  // anything but #f counts as true, as in if
+  bool truthy() const;
+  // as the repl would print it
+  std::string repr() const;
+};
+
+// the scope a call is made in, which values are made in and functions are
+// called from
+class Context {
+protected:
+  Env *env;
+  Limits limits; // for calls made while nothing else is counting
+  explicit Context(Env *env) : env(env) {}
+
+public:
+  Value number(double x);
+  Value string(const std::string &str);
+  Value boolean(bool b);
+  Value list(const std::vector<Value> &elems);
+  // call fn on count arguments
+  Value apply(Value fn, const Value *args, std::size_t count);
+  // call fn, converting each argument to a value
+  template <typename... Args> Value call(Value fn, Args &&... args) {
+    Value values[sizeof...(Args) + 1] = {value(std::forward<Args>(args))...};
+    return apply(fn, values, sizeof...(Args));
+  }
+
+private:
+  Value value(Value v) { return v; }
+  Value value(double x) { return number(x); }
+  Value value(int x) { return number(x); }
+  Value value(long x) { return number(x); }
+  Value value(unsigned x) { return number(x); }
+  Value value(unsigned long x) { return number(x); }
+  Value value(bool b) { return boolean(b); }
+  Value value(const char *str) { return string(str); }
+  Value value(const std::string &str) { return string(str); }
+};
+
+// a C++ function callable from lisp. Its arguments are evaluated before it
+// is called, and it makes its result in the context it is given, which is
+// the interpreter calling it
+using NativeFunction =
+    std::function<Value(Context &, const Value *args, std::size_t count)>;
+
+// source text parsed ahead of time. It is only valid with the interpreter
+// which compiled it
+class Program {
+private:
+  std::vector<SExp *> forms; // in the interpreter's code arena
+  friend class Interpreter;
+};
+
+class Interpreter : public Context {
+private:
+  std::unique_ptr<GlobalEnv> global;
+  // evaluate each form in turn, collecting between them if collect is true
+  Value run(const std::vector<SExp *> &forms, bool collect);
+
+public:
+  // standard output of the lisp program goes to console
+  Interpreter(std::ostream &console = std::cout);
+  ~Interpreter();
+  Interpreter(const Interpreter &) = delete;
+  Interpreter &operator=(const Interpreter &) = delete;
+
+  // parse source, throwing parser_error if it isn't valid. The code lasts
+  // as long as the interpreter
+  Program compile(const std::string &source);
+  // evaluate each form in turn, returning the value of the last
+  Value eval(const Program &program);
+  Value eval(const std::string &source);
+  // the value of a global, throwing evaluation_error if it isn't defined
+  Value lookup(const std::string &name);
+  void define(const std::string &name, Value value);
+  void define(const std::string &name, NativeFunction fn);
+
+  // each eval, and each call from C++, gets a budget of limits (see
+  // budget.h)
+  void set_limits(const Limits &l) { limits = l; }
+  void set_max_heap(std::size_t bytes);
+  void set_gc_threads(unsigned n);
+  void set_workers(unsigned n);
+  // this does nothing if it's called from a native function
+  void collect_garbage();
+
+  using Context::call;
+  // look the function up and call it
+  template <typename... Args> Value call(const std::string &name,
+                                         Args &&... args) {
+    return call(lookup(name), std::forward<Args>(args)...);
+  }
+};
+
+} // namespace lisp
+
+#endif
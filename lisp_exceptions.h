@@ -39,6 +39,14 @@ public:
   io_error(std::string msg) : lisp_error("IO error: ", msg) {}
 };
 
+// raised when an evaluation goes past one of the limits it was given (see
+// budget.h). It is not an evaluation_error, so whatever started the
+// evaluation can tell a program which ran out of budget from a broken one
+class budget_exceeded : public lisp_error {
+public:
+  budget_exceeded(std::string msg) : lisp_error("Budget exceeded: ", msg) {}
+};
+
 class exit_interpreter : public lisp_error {
 public:
   exit_interpreter() : lisp_error("exit", "") {}
@@ -6,46 +6,301 @@ as a REPL, or, if it is passed command line arguments, tries to
 open a file and interpret it as a script.
 
 */
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+#include "budget.h"
 #include "env.h"
+#include "image.h"
+#include "iobuf.h"
 #include "lexer.h"
 #include "lisp_exceptions.h"
 #include "parser.h"
 #include "sexp.h"
 
+/*
+Interpreter options are given as flags before the script name, e.g.
+  main --gc-threads 4 --gc copying --max-heap 512M --hash-cons script.lisp
+--workers N sets how many threads pmap, pfilter and preduce use.
+anything after the script name is passed to the script in ARGV.
+With --jobs N, all the arguments after the flags are scripts, which are run
+N at a time (see run_jobs).
+With --serve path, the interpreter loads the arguments after the flags as a
+prelude, then takes programs to run from a socket at path (see serve).
+--prefork N has it serve them from N worker processes (see prefork), and
+--request-timeout MS limits how long a client may take to send its program
+(10 seconds by default).
+With --save-image path, the interpreter runs the scripts after the flags,
+then saves what they defined to an image at path (see save). --image path
+starts the interpreter from an image, in any mode.
+--max-steps N, --max-depth N, --max-alloc SIZE and --timeout MS give each
+script, served program or expression typed at the repl a budget (see
+budget.h). A prelude isn't limited.
+The values of the numeric flags must be whole numbers, with a K, M or G
+suffix allowed for sizes: anything else is refused with an error, rather
+than read as whatever prefix of it is a number.
+*/
+struct Options {
+  unsigned gc_threads;
+  bool gc_threads_given;
+  Collector collector;
+  std::size_t max_heap;
+  bool hash_consing;
+  unsigned jobs; // 0 to run a single script
+  unsigned workers;
+  bool workers_given;
+  const char *socket; // where to serve requests, or null
+  unsigned prefork;   // worker processes serving requests, 0 for none
+  const char *image;  // an image to start from, or null
+  const char *save;   // where to save an image, or null
+  std::chrono::milliseconds request_timeout;
+  Limits limits;
+  Options()
+      : gc_threads(std::thread::hardware_concurrency()),
+        gc_threads_given(false), collector(Collector::mark_sweep),
+        max_heap(0), hash_consing(false), jobs(0),
+        workers(std::thread::hardware_concurrency()), workers_given(false),
+        socket(nullptr), prefork(0), image(nullptr), save(nullptr),
+        request_timeout(10000) {}
+  void apply(GlobalEnv &env) {
+    env.set_gc_threads(gc_threads);
+    env.set_collector(collector);
+    env.set_max_heap(max_heap);
+    env.set_hash_consing(hash_consing);
+    env.set_workers(workers);
+  }
+};
+
+// read a size in bytes, with an optional K, M or G suffix, into size,
+// returning false if str isn't one or it is too big
+bool parse_size(const char *str, std::size_t &size) {
+  if (!std::isdigit(static_cast<unsigned char>(*str))) {
+    return false;
+  }
+  char *suffix;
+  errno = 0;
+  unsigned long long value = std::strtoull(str, &suffix, 10);
+  int shift = 0;
+  switch (*suffix) {
+  case 'G':
+  case 'g':
+    shift += 10;
+    [[fallthrough]];
+  case 'M':
+  case 'm':
+    shift += 10;
+    [[fallthrough]];
+  case 'K':
+  case 'k':
+    shift += 10;
+    ++suffix;
+    break;
+  }
+  if (*suffix != '\0' || errno == ERANGE ||
+      value > std::numeric_limits<std::size_t>::max() >> shift) {
+    return false;
+  }
+  size = std::size_t(value) << shift;
+  return true;
+}
+
+// read a whole number into count, returning false if str isn't one or it is
+// too big for count
+template <typename T> bool parse_count(const char *str, T &count) {
+  if (!std::isdigit(static_cast<unsigned char>(*str))) {
+    return false;
+  }
+  char *end;
+  errno = 0;
+  unsigned long long value = std::strtoull(str, &end, 10);
+  if (*end != '\0' || errno == ERANGE ||
+      value > static_cast<unsigned long long>(std::numeric_limits<T>::max())) {
+    return false;
+  }
+  count = static_cast<T>(value);
+  return true;
+}
+
+// read a number of milliseconds into time, returning false if str isn't one
+bool parse_time(const char *str, std::chrono::milliseconds &time) {
+  std::chrono::milliseconds::rep count;
+  if (!parse_count(str, count)) {
+    return false;
+  }
+  time = std::chrono::milliseconds(count);
+  return true;
+}
+
+// parse the leading flags in argv into opts, returning the index of the
+// first argument which is not an option, or -1 if the flags are malformed
+int parse_options(int argc, char *argv[], Options &opts) {
+  int i = 1;
+  for (; i < argc && std::strncmp(argv[i], "--", 2) == 0; ++i) {
+    std::string flag = argv[i];
+    // flags which don't take a value
+    if (flag == "--hash-cons") {
+      opts.hash_consing = true;
+      continue;
+    }
+    if (i + 1 == argc) {
+      std::cout << "Missing value for option " << flag << std::endl;
+      return -1;
+    }
+    char *value = argv[++i];
+    bool valid = true;
+    if (flag == "--gc-threads") {
+      valid = parse_count(value, opts.gc_threads);
+      opts.gc_threads_given = true;
+    } else if (flag == "--workers") {
+      valid = parse_count(value, opts.workers);
+      opts.workers_given = true;
+    } else if (flag == "--jobs") {
+      valid = parse_count(value, opts.jobs);
+    } else if (flag == "--serve") {
+      opts.socket = value;
+    } else if (flag == "--image") {
+      opts.image = value;
+    } else if (flag == "--save-image") {
+      opts.save = value;
+    } else if (flag == "--request-timeout") {
+      valid = parse_time(value, opts.request_timeout);
+    } else if (flag == "--prefork") {
+      valid = parse_count(value, opts.prefork);
+    } else if (flag == "--max-steps") {
+      valid = parse_count(value, opts.limits.steps);
+    } else if (flag == "--max-depth") {
+      valid = parse_count(value, opts.limits.depth);
+    } else if (flag == "--max-alloc") {
+      valid = parse_size(value, opts.limits.bytes);
+    } else if (flag == "--timeout") {
+      valid = parse_time(value, opts.limits.time);
+    } else if (flag == "--max-heap") {
+      valid = parse_size(value, opts.max_heap);
+    } else if (flag == "--gc" && std::string(value) == "mark-sweep") {
+      opts.collector = Collector::mark_sweep;
+    } else if (flag == "--gc" && std::string(value) == "copying") {
+      opts.collector = Collector::copying;
+    } else {
+      std::cout << "Unknown option " << flag << std::endl;
+      return -1;
+    }
+    if (!valid) {
+      std::cout << "Invalid value " << value << " for option " << flag
+                << std::endl;
+      return -1;
+    }
+  }
+  return i;
+}
+
+// set env up as opts say, returning false if it can't start from the image
+// it was given
+bool setup(GlobalEnv &env, Options &opts, std::ostream &console) {
+  opts.apply(env);
+  if (opts.image) {
+    try {
+      load_image(env, opts.image);
+    } catch (lisp_error &e) {
+      console << e.what() << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
 /*
 If this program is called with no arguments, launch a
 read-eval-print-loop, where commands are interpreted and the results
 printed interactively
 */
 
-int repl() {
-  auto psr = Parser(std::cin);
+int repl(Options &opts) {
   GlobalEnv env;
+  if (!setup(env, opts, std::cout)) {
+    return 1;
+  }
+  // expressions are read through std-input-port's buffer, so a program
+  // reading standard input gets the lines typed after it
+  std::istream input(&env.console_input());
+  input.tie(&std::cout);
+  auto psr = Parser(input);
   while (true) {
     try {
       std::cout << " <<=  ";
-      auto sexp = psr.read_sexp(env);
+      SExp *sexp;
+      {
+        std::lock_guard<PortLock> guard(env.console_input_lock());
+        sexp = psr.read_sexp(env);
+      }
       if (!sexp) {
         // EOF character: exit the interpreter
         throw exit_interpreter();
       }
-      sexp = sexp->eval(env);
+      {
+        Budget budget(opts.limits);
+        sexp = sexp->eval(env);
+      }
       std::cout << " --> " << *sexp << std::endl;
-      env.collect_garbage();
+      env.maybe_collect_garbage();
     } catch (exit_interpreter &e) {
       break;
     } catch (std::exception &e) {
       std::cout << e.what() << std::endl;
-      std::cin.clear();
-      std::cin.ignore(1000, '\n');
+      // clean up after the failed expression straight away, in case it
+      // failed by running out of heap
+      env.collect_garbage();
+      // skip the rest of the line the error happened on
+      input.clear();
+      psr.discard_buffered();
     }
   }
   return 0;
 }
 
+// evaluate each expression psr reads in env, within limits, returning the
+// exit status. With streaming, each expression's output is sent on as soon
+// as it has run
+int run(Parser &psr, GlobalEnv &env, const char *filename,
+        std::ostream &console, const Limits &limits = Limits(),
+        bool streaming = false) {
+  try {
+    Budget budget(limits);
+    for (SExp *exp = psr.read_sexp(env); exp; exp = psr.read_sexp(env)) {
+      exp->eval(env);
+      env.maybe_collect_garbage();
+      if (streaming) {
+        console.flush();
+      }
+    }
+  } catch (exit_interpreter &e) {
+    return 0;
+  } catch (std::exception &e) {
+    // if an error occurs, report the file and the line so the user can find
+    // it easily
+    console << "[" << filename << ":" << psr.get_linenum() << ":"
+            << psr.get_linepos() << "] " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
 /*
 If the program is called with arguments, the first argument is interpreted
 as a filename for the a script, and the script is opened and the results
@@ -56,44 +311,310 @@ If there are more commands in argv, they are made avaliable to the
 script as a list of strings in the variable ARGV.
 */
 
-int script(int argc, char *argv[]) {
+int script(int argc, char *argv[], Options &opts,
+           std::ostream &console = std::cout) {
   char *filename = argv[1];
 
-  std::ifstream file;
-  file.open(filename);
-  if (!file.is_open()) {
-    std::cout << "Couldn't open file " << filename << std::endl;
+  // the whole script is mapped into memory and lexed in place
+  std::unique_ptr<MappedFile> file;
+  try {
+    file.reset(new MappedFile(filename));
+  } catch (io_error &e) {
+    console << "Couldn't open file " << filename << std::endl;
+    return 1;
+  }
+  auto psr = Parser(file->begin(), file->end());
+  GlobalEnv env(console);
+  if (!setup(env, opts, console)) {
     return 1;
   }
-  auto psr = Parser(file);
-  GlobalEnv env;
-  env.bind_argv(argc, argv);
   try {
+    env.bind_argv(argc, argv);
+  } catch (lisp_error &e) {
+    console << e.what() << std::endl;
+    return 1;
+  }
+  return run(psr, env, filename, console, opts.limits);
+}
 
-    SExp *exp = psr.read_sexp(env);
-    while (file.good()) {
+/*
+With --jobs N, each script is run in its own interpreter, on one of N
+threads. Interpreters share nothing, so they don't need to synchronise.
+Each script's output is collected in memory, and written out whole once it
+and every script before it have finished, so the output is the same as
+running the scripts one after another. Returns 1 if any script failed.
+*/
 
-      exp->eval(env);
-      env.collect_garbage();
-      exp = psr.read_sexp(env);
+int run_jobs(int count, char *scripts[], Options &opts) {
+  // the interpreters are already keeping every core busy
+  if (!opts.gc_threads_given) {
+    opts.gc_threads = 1;
+  }
+  if (!opts.workers_given) {
+    opts.workers = 1;
+  }
+  std::vector<std::string> output(count);
+  std::vector<bool> finished(count, false);
+  int written = 0;
+  bool failed = false;
+  std::mutex lock;
+  std::atomic<int> next(0);
+
+  auto worker = [&]() {
+    for (int i = next++; i < count; i = next++) {
+      std::ostringstream console;
+      char *argv[] = {nullptr, scripts[i]};
+      bool ok = script(2, argv, opts, console) == 0;
+
+      std::lock_guard<std::mutex> guard(lock);
+      output[i] = console.str();
+      finished[i] = true;
+      failed = failed || !ok;
+      for (; written < count && finished[written]; ++written) {
+        std::cout << output[written];
+        output[written].clear();
+      }
+      std::cout.flush();
     }
-  } catch (exit_interpreter &e) {
-    return 0;
+  };
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < opts.jobs; ++i) {
+    threads.emplace_back(worker);
+  }
+  for (auto it = threads.begin(); it != threads.end(); ++it) {
+    it->join();
+  }
+  return failed ? 1 : 0;
+}
+
+/*
+With --serve path, the interpreter loads its prelude once, then waits for
+programs on a Unix domain socket at path, and runs each in turn. A request
+is the program's ARGV, a line per argument starting with its name, then a
+blank line, then the program's text, up to the end of what the client sends.
+Everything the program writes to standard output is sent back as it runs,
+followed by any error, and the connection is closed when it finishes.
+
+Each program runs in an interpreter of its own layered over the one holding
+the prelude, so it starts with the prelude's definitions without parsing or
+evaluating them again, and nothing it defines is seen by the next. Programs
+are run one at a time, in the order they arrive, unless the server has
+worker processes to run them (see prefork). A client which takes longer
+than --request-timeout to send its program is sent an error instead, so
+that it can't hold up the clients waiting behind it.
+
+The prelude's functions close over its own std-output-port, so while a
+program runs, the prelude's standard output is sent to the client too, and
+goes back to the server's once it finishes. A program can't resume a
+coroutine the prelude made (see coroutine.h).
+*/
+
+void serve_request(int fd, GlobalEnv &prelude, const Options &opts) {
+  OutputBuffer out(fd, true);
+  std::ostream console(&out);
+  std::string request;
+  try {
+    request = read_connection(fd, opts.request_timeout);
+  } catch (io_error &e) {
+    console << e.what() << std::endl;
+    return;
+  }
+  std::vector<std::string> args;
+  std::string source;
+  {
+    InputBuffer in(request.data(), request.data() + request.size());
+    std::string line;
+    while (in.read_line(line) && !line.empty()) {
+      args.push_back(line);
+    }
+    in.read_all(source);
+  }
+  std::vector<char *> argv{nullptr};
+  for (auto it = args.begin(); it != args.end(); ++it) {
+    argv.push_back(&(*it)[0]);
+  }
+  const char *name = args.empty() ? "request" : args.front().c_str();
+  auto psr = Parser(source.data(), source.data() + source.size());
+  OutPort *std_out =
+      dynamic_cast<OutPort *>(prelude.lookup("std-output-port"));
+  if (std_out) {
+    std_out->redirect(console);
+  }
+  try {
+    GlobalEnv env(prelude, console);
+    env.bind_argv(argv.size(), argv.data());
+    run(psr, env, name, console, opts.limits, true);
   } catch (std::exception &e) {
-    // if an error occurs, report the file and the line so the user can find
-    // it easily
-    std::cout << "[" << filename << ":" << psr.get_linenum() << ":"
-              << psr.get_linepos() << "] " << e.what() << std::endl;
+    console << e.what() << std::endl;
+  }
+  console.flush();
+  if (std_out) {
+    std_out->redirect(std::cout);
+  }
+}
+
+// take requests from listener and serve them, one after another, for good
+void accept_requests(int listener, GlobalEnv &prelude, Options &opts) {
+  while (true) {
+    try {
+      serve_request(accept_connection(listener), prelude, opts);
+    } catch (io_error &e) {
+      std::cout << e.what() << std::endl;
+    }
+  }
+}
+
+/*
+With --prefork N as well, the server forks N worker processes once the
+prelude is loaded, which take turns accepting connections on its socket,
+so that up to N programs run at once. Each worker starts with the prelude
+as it was at the fork, and the pages holding it stay shared, copy on
+write, between the server and all of the workers: programs run in layers
+over the prelude, and the collector's marks aren't written to what a layer
+is layered over. Only what a program changes in the prelude is copied into
+its worker, such as a bytevector it sets bytes of, along with the prelude's
+standard output, which is pointed at each client in turn. Those changes
+are seen by the later programs that worker runs, but not by other workers
+(see heap.h). The server itself only waits for workers to die, and starts
+new ones to replace them.
+*/
+
+pid_t start_worker(int listener, GlobalEnv &prelude, Options &opts) {
+  pid_t server = getpid();
+  pid_t pid = fork();
+  if (pid == 0) {
+    // a worker doesn't outlive the server, even if it was killed
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != server) {
+      std::_Exit(1);
+    }
+    accept_requests(listener, prelude, opts);
+  } else if (pid < 0) {
+    std::cout << "Couldn't start a worker: " << std::strerror(errno)
+              << std::endl;
+  }
+  return pid;
+}
+
+int prefork(int listener, GlobalEnv &prelude, Options &opts) {
+  // a forked process only gets the thread which forked it, so nothing can
+  // be left running on another, and anything written but not sent yet
+  // would be sent by every worker
+  prelude.join_threads();
+  std::cout.flush();
+  for (unsigned i = 0; i < opts.prefork; ++i) {
+    if (start_worker(listener, prelude, opts) < 0) {
+      return 1;
+    }
+  }
+  while (true) {
+    int status;
+    if (wait(&status) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 1;
+    }
+    if (start_worker(listener, prelude, opts) < 0) {
+      return 1;
+    }
+  }
+}
+
+// run each of the files in env, without limits, returning false if any
+// fails
+bool run_files(int count, char *files[], GlobalEnv &env) {
+  for (int i = 0; i < count; ++i) {
+    std::unique_ptr<MappedFile> file;
+    try {
+      file.reset(new MappedFile(files[i]));
+    } catch (io_error &e) {
+      std::cout << "Couldn't open file " << files[i] << std::endl;
+      return false;
+    }
+    auto psr = Parser(file->begin(), file->end());
+    if (run(psr, env, files[i], std::cout) != 0) {
+      return false;
+    }
+  }
+  std::cout.flush();
+  return true;
+}
+
+int serve(int count, char *preludes[], Options &opts) {
+  // values made by a request couldn't be found among the prelude's
+  if (opts.hash_consing) {
+    std::cout << "--hash-cons can't be used with --serve" << std::endl;
+    return 1;
+  }
+  GlobalEnv env;
+  if (!setup(env, opts, std::cout) || !run_files(count, preludes, env)) {
     return 1;
   }
+  env.collect_garbage();
+  // a client which hangs up early makes writes to it fail, rather than
+  // ending the server
+  std::signal(SIGPIPE, SIG_IGN);
+  int listener;
+  try {
+    listener = listen_socket(opts.socket);
+  } catch (io_error &e) {
+    std::cout << e.what() << std::endl;
+    return 1;
+  }
+  if (opts.prefork > 0) {
+    return prefork(listener, env, opts);
+  }
+  accept_requests(listener, env, opts);
   return 0;
 }
 
-int main(int argc, char *argv[]) {
+/*
+With --save-image path, the scripts are run one after another in the same
+interpreter, like a prelude, and then everything they defined is saved to
+an image at path. Starting from the image with --image gives an interpreter
+with the same definitions, without running the scripts again.
+*/
 
-  if (argc == 1) {
-    return repl();
+int save(int count, char *scripts[], Options &opts) {
+  GlobalEnv env;
+  if (!setup(env, opts, std::cout) || !run_files(count, scripts, env)) {
+    return 1;
+  }
+  try {
+    save_image(env, opts.save);
+  } catch (lisp_error &e) {
+    std::cout << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  // nothing uses stdio, so let the standard streams buffer output
+  // themselves
+  std::ios::sync_with_stdio(false);
+  Options opts;
+  int first = parse_options(argc, argv, opts);
+  if (first < 0) {
+    return 1;
+  }
+  if (opts.prefork > 0 && !opts.socket) {
+    std::cout << "--prefork needs --serve" << std::endl;
+    return 1;
+  } else if (opts.save) {
+    return save(argc - first, argv + first, opts);
+  } else if (opts.socket) {
+    return serve(argc - first, argv + first, opts);
+  } else if (opts.jobs > 0 && first == argc) {
+    std::cout << "--jobs needs scripts to run" << std::endl;
+    return 1;
+  } else if (opts.jobs > 0) {
+    return run_jobs(argc - first, argv + first, opts);
+  } else if (first == argc) {
+    return repl(opts);
   } else {
-    return script(argc, argv);
+    // shift argv so the script name is argv[1], as script expects
+    return script(argc - first + 1, argv + first - 1, opts);
   }
 }
\ No newline at end of file
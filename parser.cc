@@ -1,53 +1,63 @@
 #include "parser.h"
 
-
+// Expressions are read with an explicit stack of the lists that are open:
+// an opening bracket or quote pushes a frame, and each complete expression
+// is appended to the innermost frame, closing any quote frames it finishes.
+// When the stack is empty the expression is a whole top level form.
 SExp *Parser::read_sexp(Env &env) {
-  auto token = lexer.get_token();
-  if (token == Token::eof) {
-    return nullptr;
+  stack.clear();
+  for (;;) {
+    auto token = lexer.get_token();
+    SExp *value;
+    switch (token) {
+    case Token::open_bracket:
+      stack.push_back(Frame{{}, false});
+      continue;
+    case Token::kw_quote:
+      stack.push_back(Frame{{make<Atom>(env, "quote")}, true});
+      continue;
+    case Token::close_bracket:
+      if (stack.empty() || stack.back().quote) {
+        throw parser_error("Unexpected )");
+      }
+      value = make<List>(env, std::move(stack.back().elems));
+      stack.pop_back();
+      break;
+    case Token::eof:
+      if (stack.empty()) {
+        return nullptr;
+      }
+      throw parser_error("Unexpected EOF");
+    default:
+      value = parse_atomic(env, token);
+    }
+    for (;;) {
+      if (stack.empty()) {
+        return value;
+      }
+      Frame &frame = stack.back();
+      frame.elems.push_back(value);
+      if (!frame.quote) {
+        break;
+      }
+      value = make<List>(env, std::move(frame.elems));
+      stack.pop_back();
+    }
   }
-  return parse(env, token);
 }
-SExp *Parser::parse(Env &env, Token token) {
+SExp *Parser::parse_atomic(Env &env, Token token) {
   switch (token) {
-  case Token::open_bracket:
-    return parse_list(env);
   case Token::num:
-    return env.manage(new Number(lexer.get_parsed_num()));
+    return make<Number>(env, lexer.get_parsed_num());
   case Token::string:
-    return env.manage(new String(lexer.get_parsed_str()));
+    return make<String>(env, std::string(lexer.get_parsed_str()));
   case Token::atom:
-    return env.manage(new Atom(lexer.get_parsed_str()));
+    return make<Atom>(env, std::string(lexer.get_parsed_str()));
   case Token::kw_true:
-    return env.manage(new Bool(true));
+    return make<Bool>(env, true);
   case Token::kw_false:
-    return env.manage(new Bool(false));
-  case Token::kw_quote:
-    return mk_quoted_list(env);
-  case Token::eof:
-    throw parser_error("Unexpected EOF");
-  case Token::close_bracket:
-    // these shouldn't be encountered outside the list parse function
-    throw parser_error("Unexpected )");
+    return make<Bool>(env, false);
   default:
-    std::cout << "Found " << int(token) << std::endl;
     throw implementation_error("Non-irrefutable patterns in parser");
   }
 }
-SExp *Parser::parse_list(Env &env) {
-  std::list<SExp *> elems;
-  for (auto token = lexer.get_token(); token != Token::close_bracket;
-       token = lexer.get_token()) {
-    auto elem = parse(env, token);
-    elems.push_back(elem);
-  }
-  return env.manage(new List(elems));
-}
-// this supports the backtick quote syntactic sugar: '(1 2) is transformed to
-// (quote (1 2)) as a macro (i.e before the code is interpreted)
-SExp *Parser::mk_quoted_list(Env &env) {
-  std::list<SExp *> elems;
-  elems.push_back(env.manage(new Atom("quote")));
-  elems.push_back(parse(env, lexer.get_token()));
-  return env.manage(new List(elems));
-}
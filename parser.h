@@ -6,26 +6,53 @@
 #include "lexer.h"
 #include "lisp_exceptions.h"
 #include "sexp.h"
+#include <list>
+#include <vector>
 
 // The parser converts a stream of characters inputted to it to
 // expressions of the lisp language. It encapsulates the lower
 // level lexer class.
 
+// Program text is parsed into the code arena, which lives as long as the
+// interpreter and isn't garbage collected. Data read at runtime (by the
+// read function) is put in the heap like any other value.
+enum class ParseMode { code, data };
+
 class Parser {
 public:
-  Parser(std::istream &instream) : lexer(Lexer(instream)) {}
+  Parser(std::istream &instream, ParseMode mode = ParseMode::code)
+      : lexer(instream), mode(mode) {}
+  // parse the characters in [begin, end), which must outlive the parser
+  Parser(const char *begin, const char *end, ParseMode mode = ParseMode::code)
+      : lexer(begin, end), mode(mode) {}
   SExp *read_sexp(Env &env);
+  // throw away the rest of any partly read input, e.g. after an error
+  void discard_buffered() { lexer.discard_buffered(); }
   int get_linenum() { return lexer.get_linenum(); }
   int get_linepos() { return lexer.get_linepos(); }
 private:
-  SExp *parse(Env &env, Token token);
+  // a list whose elements are still being read. The quote sugar '(1 2) is
+  // read as a list (quote (1 2)) which ends after one element
+  struct Frame {
+    std::list<SExp *> elems;
+    bool quote;
+  };
   Lexer lexer;
-  SExp *parse_list(Env &env);
-  // this supports the backtick quote syntactic sugar: '(1 2) is
-  // transformed
-  // to
-  // (quote (1 2))
-  SExp *mk_quoted_list(Env &env);
+  ParseMode mode;
+  // the lists enclosing the expression being read, innermost last. Keeping
+  // these here rather than on the C++ stack means the depth of nesting is
+  // only limited by memory
+  std::vector<Frame> stack;
+  // allocate a new T in the code arena or the heap, depending on mode. When
+  // the heap is hash consing, code is shared with data so goes in the heap
+  template <typename T, typename... Args> SExp *make(Env &env, Args &&... args) {
+    if (mode == ParseMode::code && !env.hash_consing()) {
+      return env.code().make<T>(std::forward<Args>(args)...);
+    }
+    return env.manage(new T(std::forward<Args>(args)...));
+  }
+  // the value of a token that is a whole expression by itself
+  SExp *parse_atomic(Env &env, Token token);
 };
 
 #endif
\ No newline at end of file
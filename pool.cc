@@ -0,0 +1,99 @@
+#include "pool.h"
+#include <atomic>
+#include <exception>
+#include <system_error>
+#include <thread>
+
+// cut the work into this many chunks per thread, so there is something
+// left to steal when the tasks take uneven amounts of time
+static const std::size_t chunks_per_thread = 8;
+
+static thread_local bool in_pool = false;
+
+bool WorkPool::on_worker() { return in_pool; }
+
+// take a chunk from the front of our own deque, or steal one from the back
+// of someone else's
+bool WorkPool::take(std::vector<ChunkDeque> &deques, unsigned self,
+                    Chunk &out) {
+  for (unsigned i = 0; i < threads; ++i) {
+    ChunkDeque &d = deques[(self + i) % threads];
+    std::lock_guard<std::mutex> guard(d.lock);
+    if (!d.chunks.empty()) {
+      if (i == 0) {
+        out = d.chunks.front();
+        d.chunks.pop_front();
+      } else {
+        out = d.chunks.back();
+        d.chunks.pop_back();
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkPool::run(std::size_t count,
+                   const std::function<void(std::size_t, unsigned)> &task) {
+  if (threads == 1 || count < 2 || in_pool) {
+    bool outer = in_pool;
+    in_pool = true;
+    try {
+      for (std::size_t i = 0; i < count; ++i) {
+        task(i, 0);
+      }
+    } catch (...) {
+      in_pool = outer;
+      throw;
+    }
+    in_pool = outer;
+    return;
+  }
+  std::size_t size = count / (threads * chunks_per_thread);
+  size = size > 0 ? size : 1;
+  // deal out the chunks so each thread starts on a contiguous run of them
+  std::vector<ChunkDeque> deques(threads);
+  std::size_t nchunks = (count + size - 1) / size;
+  for (std::size_t c = 0; c < nchunks; ++c) {
+    std::size_t end = (c + 1) * size < count ? (c + 1) * size : count;
+    deques[c * threads / nchunks].chunks.push_back(Chunk{c * size, end});
+  }
+  std::atomic<bool> failed(false);
+  std::exception_ptr error;
+  std::mutex error_lock;
+
+  auto worker = [&, this](unsigned self) {
+    in_pool = true;
+    Chunk chunk;
+    while (!failed && take(deques, self, chunk)) {
+      try {
+        for (std::size_t i = chunk.begin; i < chunk.end && !failed; ++i) {
+          task(i, self);
+        }
+      } catch (...) {
+        std::lock_guard<std::mutex> guard(error_lock);
+        if (!error) {
+          error = std::current_exception();
+        }
+        failed = true;
+      }
+    }
+    in_pool = false;
+  };
+
+  std::vector<std::thread> pool;
+  try {
+    for (unsigned i = 1; i < threads; ++i) {
+      pool.push_back(std::thread(worker, i));
+    }
+  } catch (const std::system_error &) {
+    // carry on with the threads we have: they'll steal the missing ones' work
+  }
+  worker(0);
+  for (auto it = pool.begin(); it != pool.end(); ++it) {
+    it->join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
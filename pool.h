@@ -0,0 +1,50 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+/*
+A work pool runs a batch of independent tasks, numbered from 0, on several
+threads. The tasks are cut into chunks of consecutive numbers which are
+dealt out between per-thread deques. Each thread works through its own
+deque from the front, and when that runs dry it steals chunks from the back
+of the others', so a few slow tasks don't leave the rest of the threads
+idle. The thread which calls run takes part as one of the workers, and run
+returns once every task has finished.
+
+Tasks never create more tasks, so a thread can stop as soon as it finds
+every deque empty. If a task throws, the tasks which haven't started yet
+are skipped and the first exception is rethrown from run.
+
+A task which itself asks for parallel work is already running on a worker,
+and gets it done serially on its own thread rather than starting more.
+*/
+
+class WorkPool {
+private:
+  struct Chunk {
+    std::size_t begin;
+    std::size_t end;
+  };
+  struct ChunkDeque {
+    std::mutex lock;
+    std::deque<Chunk> chunks;
+  };
+  unsigned threads;
+  bool take(std::vector<ChunkDeque> &deques, unsigned self, Chunk &out);
+
+public:
+  WorkPool(unsigned threads) : threads(threads > 0 ? threads : 1) {}
+  // call task(i, worker) for each i in [0, count), where worker is the
+  // number, below the thread count, of the thread running it
+  void run(std::size_t count,
+           const std::function<void(std::size_t, unsigned)> &task);
+  // true on a thread which is running a task for some pool
+  static bool on_worker();
+};
+
+#endif
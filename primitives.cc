@@ -1,6 +1,11 @@
+#include "coroutine.h"
+#include "csv.h"
+#include "future.h"
+#include "iobuf.h"
 #include "parser.h"
 #include "primitives.h"
 #include <algorithm>
+#include <new>
 #include <numeric>
 #include <typeinfo>
 
@@ -217,8 +222,14 @@ SExp *primitive::eq(std::list<SExp *> args, Env &env) {
   if (type1 != type2) {
     result = false;
   } else if (type1 == typeid(Number).hash_code()) {
+    // numbers are interned by their bits, so 0 and -0 are different objects
+    // and a NaN is the same object as itself: compare their values even when
+    // hash consing
     result = (static_cast<Number *>(arg1)->val() ==
               static_cast<Number *>(arg2)->val());
+  } else if (env.hash_consing()) {
+    // equal values are the same object
+    result = (arg1 == arg2);
   } else if (type1 == typeid(String).hash_code()) {
     result = (static_cast<String *>(arg1)->val() ==
               static_cast<String *>(arg2)->val());
@@ -269,7 +280,7 @@ SExp *primitive::open_output_port(std::list<SExp *> args, Env &env) {
     throw evaluation_error(
         "Invalid argument to function open-output-port: expected string");
   }
-  std::string name = sp->val();
+  std::string name(sp->val());
 
   try {
     return env.manage(new OutPort(name));
@@ -292,7 +303,7 @@ SExp *primitive::open_input_port(std::list<SExp *> args, Env &env) {
     throw evaluation_error(
         "Invalid argument to function open-output-port: expected string");
   }
-  std::string name = sp->val();
+  std::string name(sp->val());
 
   try {
     return env.manage(new InPort(name));
@@ -338,12 +349,76 @@ SExp *primitive::port_to_string(std::list<SExp *> args, Env &env) {
   }
 }
 
+// string ports read from and write to strings in memory instead of files, so
+// that output can be built up with display in linear time
+SExp *primitive::open_output_string(std::list<SExp *> args, Env &env) {
+  if (args.size() != 0) {
+    throw evaluation_error(
+        "Invalid number of arguments in function open-output-string");
+  }
+  return env.manage(new OutPort(
+      std::unique_ptr<std::streambuf>(new std::stringbuf), "string"));
+}
+
+SExp *primitive::get_output_string(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1) {
+    throw evaluation_error(
+        "Invalid number of arguments in function get-output-string");
+  }
+  SExp *arg = args.front()->eval(env);
+  OutPort *op = dynamic_cast<OutPort *>(arg);
+  if (!op || !op->is_string_port()) {
+    throw evaluation_error(
+        "Type error: expected a string port in function get-output-string");
+  }
+  return env.manage(new String(op->contents()));
+}
+
+SExp *primitive::open_input_string(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1) {
+    throw evaluation_error(
+        "Invalid number of arguments in function open-input-string");
+  }
+  SExp *arg = args.front()->eval(env);
+  String *sp = dynamic_cast<String *>(arg);
+  if (!sp) {
+    throw evaluation_error(
+        "Invalid argument to function open-input-string: expected string");
+  }
+  std::string_view str = sp->val();
+  return env.manage(new InPort(std::unique_ptr<InputBuffer>(new InputBuffer(
+                                   str.data(), str.data() + str.size())),
+                               "string"));
+}
+
+// read the next line from a port, or standard input if none is given
+SExp *primitive::read_line(std::list<SExp *> args, Env &env) {
+  SExp *input_port;
+  switch (args.size()) {
+  case 0:
+    input_port = env.get_global().lookup("std-input-port");
+    break;
+  case 1:
+    input_port = args.front()->eval(env);
+    break;
+  default:
+    throw evaluation_error(
+        "Invalid number of arguments to function read-line: expected 0 or 1");
+  }
+  InPort *ip = dynamic_cast<InPort *>(input_port);
+  if (!ip) {
+    throw evaluation_error(
+        "Type error: expected a port in function read-line");
+  }
+  return ip->read_ln(env);
+}
+
 SExp *primitive::display(std::list<SExp *> args, Env &env) {
   SExp *msg, *output_port;
   switch (args.size()) {
   case 1:
     msg = args.front()->eval(env);
-    output_port = env.lookup("std-output-port");
+    output_port = env.get_global().lookup("std-output-port");
     break;
   case 2:
     msg = args.front()->eval(env);
@@ -359,12 +434,11 @@ SExp *primitive::display(std::list<SExp *> args, Env &env) {
     throw evaluation_error(
         "Cannot write to a non-port type: expected output-port");
   }
-  // write the string representation of the object to the output port
-  std::stringstream buf;
-  auto repr = DisplayRepresentor(buf);
+  // write the string representation of the object straight into the port's
+  // buffer
+  std::lock_guard<PortLock> guard(op->get_lock());
+  auto repr = DisplayRepresentor(op->stream());
   msg->exec(repr);
-
-  op->write(buf.str(), env);
   return env.lookup("null");
 }
 SExp *primitive::displayln(std::list<SExp *> args, Env &env) {
@@ -372,7 +446,7 @@ SExp *primitive::displayln(std::list<SExp *> args, Env &env) {
   switch (args.size()) {
   case 1:
     msg = args.front()->eval(env);
-    output_port = env.lookup("std-output-port");
+    output_port = env.get_global().lookup("std-output-port");
     break;
   case 2:
     msg = args.front()->eval(env);
@@ -389,16 +463,40 @@ SExp *primitive::displayln(std::list<SExp *> args, Env &env) {
     throw evaluation_error(
         "Cannot write to a non-port type: expected output-port");
   }
-  // write the string representation of the object to the output port
-  std::stringstream buf;
-  auto repr = DisplayRepresentor(buf);
+  // write the string representation of the object straight into the port's
+  // buffer
+  std::lock_guard<PortLock> guard(op->get_lock());
+  std::ostream &out = op->stream();
+  auto repr = DisplayRepresentor(out);
   msg->exec(repr);
-
-  op->write(buf.str(), env);
-  op->write("\n", env);
+  out << '\n';
 
   return env.lookup("null");
 }
+// write out anything buffered by a port, or standard output if none is given
+SExp *primitive::flush_output(std::list<SExp *> args, Env &env) {
+  SExp *output_port;
+  switch (args.size()) {
+  case 0:
+    output_port = env.get_global().lookup("std-output-port");
+    break;
+  case 1:
+    output_port = args.front()->eval(env);
+    break;
+  default:
+    throw evaluation_error(
+        "Invalid number of arguments to function flush-output: expected 0 or "
+        "1");
+  }
+  OutPort *op = dynamic_cast<OutPort *>(output_port);
+  if (!op) {
+    throw evaluation_error(
+        "Cannot flush a non-port type: expected output-port");
+  }
+  op->flush();
+  return env.lookup("null");
+}
+
 SExp *primitive::close_output_port(std::list<SExp *> args, Env &env) {
   if (args.size() != 1) {
     throw evaluation_error(
@@ -607,17 +705,819 @@ SExp *primitive::read(std::list<SExp *> args, Env &env) {
         "Invalid number of arguments in function read: expected 1");
   }
   auto arg = args.front()->eval(env);
+  // reading from a port carries on from the end of the last expression read
+  InPort *ip = dynamic_cast<InPort *>(arg);
+  if (ip) {
+    return ip->read_sexp(env);
+  }
   String *sp = dynamic_cast<String *>(arg);
   if (!sp) {
-    throw evaluation_error("Cannot read a non-string type");
+    throw evaluation_error(
+        "Cannot read a non-string type: expected string or input port");
   }
-  std::string str = sp->val();
+  std::string_view str = sp->val();
 
   // try to parse the string as an s-expression, returning its value
   // this function is problematic since there is basically no sensible
   // way to signal that this function has failed without adding exceptions
   // to the language
-  auto buf = std::stringstream(str);
-  auto parser = Parser(buf);
+  auto parser = Parser(str.data(), str.data() + str.size(), ParseMode::data);
   return parser.read_sexp(env);
 }
+
+SExp *primitive::is_eof(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function eof-object?");
+  }
+  SExp *arg = args.front()->eval(env);
+  return env.manage(new Bool(typeid(*arg) == typeid(Eof)));
+}
+
+// (for-each-line f port) calls f on each line of port in turn, without
+// building a list of them
+SExp *primitive::for_each_line(std::list<SExp *> args, Env &env) {
+  if (args.size() != 2) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function for-each-line");
+  }
+  std::for_each(args.begin(), args.end(), [&](SExp *&a) { a = a->eval(env); });
+  Function *func = dynamic_cast<Function *>(args.front());
+  if (!func) {
+    throw evaluation_error(
+        "Illegal first argument in function for-each-line: expected function");
+  }
+  InPort *ip = dynamic_cast<InPort *>(args.back());
+  if (!ip) {
+    throw evaluation_error(
+        "Illegal second argument in function for-each-line: expected port");
+  }
+  SExp *eof = env.lookup("eof");
+  for (SExp *line = ip->read_ln(env); line != eof; line = ip->read_ln(env)) {
+    func->call(std::list<SExp *>{quote_var(line, env)}, env);
+  }
+  return env.lookup("null");
+}
+
+// check arg is a whole number from 0 to max, and return it
+static std::size_t integer_arg(SExp *arg, double max, const std::string &fn) {
+  Number *np = dynamic_cast<Number *>(arg);
+  if (!np || np->val() < 0 || np->val() > max ||
+      np->val() != std::floor(np->val())) {
+    std::stringstream msg;
+    msg << "Invalid argument in function " << fn
+        << ": expected an integer from 0 to " << max;
+    throw evaluation_error(msg.str());
+  }
+  return np->val();
+}
+
+// the optional start and end of a range of a sequence of the given length,
+// the whole sequence if they are missing
+static void range_args(std::list<SExp *> &args, std::size_t length,
+                       std::size_t &start, std::size_t &end,
+                       const std::string &fn) {
+  start = args.empty() ? 0 : integer_arg(args.front(), length, fn);
+  end = args.size() < 2 ? length : integer_arg(*++args.begin(), length, fn);
+  if (start > end) {
+    throw evaluation_error("Invalid range in function " + fn +
+                           ": start is after end");
+  }
+}
+
+SExp *primitive::string_length(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function string-length");
+  }
+  String *sp = dynamic_cast<String *>(args.front()->eval(env));
+  if (!sp) {
+    throw evaluation_error(
+        "Invalid argument to function string-length: expected string");
+  }
+  return env.manage(new Number(sp->val().size()));
+}
+
+// (substring str start [end]) shares the characters of str rather than
+// copying them
+SExp *primitive::substring(std::list<SExp *> args, Env &env) {
+  if (args.size() != 2 && args.size() != 3) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function substring: expected 2 or 3");
+  }
+  std::for_each(args.begin(), args.end(), [&](SExp *&a) { a = a->eval(env); });
+  String *sp = dynamic_cast<String *>(args.front());
+  if (!sp) {
+    throw evaluation_error(
+        "Invalid first argument to function substring: expected string");
+  }
+  args.pop_front();
+  std::size_t start, end;
+  range_args(args, sp->val().size(), start, end, "substring");
+  return env.manage(new String(*sp, start, end - start));
+}
+
+// (make-bytevector size [fill])
+SExp *primitive::make_bytevector(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1 && args.size() != 2) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function make-bytevector");
+  }
+  std::for_each(args.begin(), args.end(), [&](SExp *&a) { a = a->eval(env); });
+  std::size_t size = integer_arg(args.front(), 1e15, "make-bytevector");
+  std::uint8_t fill =
+      args.size() == 2 ? integer_arg(args.back(), 255, "make-bytevector") : 0;
+  // a bytevector too big for the heap is refused before it is allocated
+  env.reserve(sizeof(Bytevector) + size);
+  Bytevector *bytes;
+  try {
+    bytes = new Bytevector(size, fill);
+  } catch (std::bad_alloc &e) {
+    throw evaluation_error("Cannot allocate a bytevector of " +
+                           std::to_string(size) + " bytes");
+  }
+  return env.manage(bytes);
+}
+
+SExp *primitive::is_bytevector(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function bytevector?");
+  }
+  SExp *arg = args.front()->eval(env);
+  return env.manage(new Bool(typeid(*arg) == typeid(Bytevector)));
+}
+
+// evaluate args, checking the first is a bytevector, which is removed and
+// returned
+static Bytevector *bytevector_args(std::list<SExp *> &args, Env &env,
+                                   const std::string &fn) {
+  std::for_each(args.begin(), args.end(), [&](SExp *&a) { a = a->eval(env); });
+  Bytevector *bp = dynamic_cast<Bytevector *>(args.front());
+  if (!bp) {
+    throw evaluation_error("Invalid first argument to function " + fn +
+                           ": expected bytevector");
+  }
+  args.pop_front();
+  return bp;
+}
+
+SExp *primitive::bytevector_length(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function bytevector-length");
+  }
+  Bytevector *bp = bytevector_args(args, env, "bytevector-length");
+  return env.manage(new Number(bp->bytes.size()));
+}
+
+SExp *primitive::bytevector_u8_ref(std::list<SExp *> args, Env &env) {
+  if (args.size() != 2) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function bytevector-u8-ref");
+  }
+  Bytevector *bp = bytevector_args(args, env, "bytevector-u8-ref");
+  double last = double(bp->bytes.size()) - 1;
+  std::size_t i = integer_arg(args.front(), last, "bytevector-u8-ref");
+  return env.manage(new Number(bp->bytes[i]));
+}
+
+SExp *primitive::bytevector_u8_set(std::list<SExp *> args, Env &env) {
+  if (args.size() != 3) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function bytevector-u8-set!");
+  }
+  Bytevector *bp = bytevector_args(args, env, "bytevector-u8-set!");
+  double last = double(bp->bytes.size()) - 1;
+  std::size_t i = integer_arg(args.front(), last, "bytevector-u8-set!");
+  bp->bytes[i] = integer_arg(args.back(), 255, "bytevector-u8-set!");
+  return env.lookup("null");
+}
+
+// (read-bytes bv port [start [end]]) fills bv, or the range of it given,
+// from port. Returns the number of bytes read, or eof if there were none
+SExp *primitive::read_bytes(std::list<SExp *> args, Env &env) {
+  if (args.size() < 2 || args.size() > 4) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function read-bytes");
+  }
+  Bytevector *bp = bytevector_args(args, env, "read-bytes");
+  InPort *ip = dynamic_cast<InPort *>(args.front());
+  if (!ip) {
+    throw evaluation_error(
+        "Invalid second argument to function read-bytes: expected port");
+  }
+  args.pop_front();
+  std::size_t start, end;
+  range_args(args, bp->bytes.size(), start, end, "read-bytes");
+  auto dest = reinterpret_cast<char *>(bp->bytes.data());
+  std::size_t count = ip->read_bytes(dest + start, end - start);
+  if (count == 0 && end > start) {
+    return env.lookup("eof");
+  }
+  return env.manage(new Number(count));
+}
+
+// (read-bytes-at bv port offset) fills bv from offset in port's file,
+// without moving the port. Returns the number of bytes read
+SExp *primitive::read_bytes_at(std::list<SExp *> args, Env &env) {
+  if (args.size() != 3) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function read-bytes-at");
+  }
+  Bytevector *bp = bytevector_args(args, env, "read-bytes-at");
+  InPort *ip = dynamic_cast<InPort *>(args.front());
+  if (!ip) {
+    throw evaluation_error(
+        "Invalid second argument to function read-bytes-at: expected port");
+  }
+  std::size_t offset = integer_arg(args.back(), 1e15, "read-bytes-at");
+  auto dest = reinterpret_cast<char *>(bp->bytes.data());
+  return env.manage(
+      new Number(ip->read_bytes_at(dest, bp->bytes.size(), offset)));
+}
+
+// (write-bytes bv port [start [end]])
+SExp *primitive::write_bytes(std::list<SExp *> args, Env &env) {
+  if (args.size() < 2 || args.size() > 4) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function write-bytes");
+  }
+  Bytevector *bp = bytevector_args(args, env, "write-bytes");
+  OutPort *op = dynamic_cast<OutPort *>(args.front());
+  if (!op) {
+    throw evaluation_error(
+        "Invalid second argument to function write-bytes: expected port");
+  }
+  args.pop_front();
+  std::size_t start, end;
+  range_args(args, bp->bytes.size(), start, end, "write-bytes");
+  auto src = reinterpret_cast<const char *>(bp->bytes.data());
+  op->write_bytes(src + start, end - start);
+  return env.lookup("null");
+}
+
+// the size of a file in bytes, or #f if it can't be found
+SExp *primitive::file_size(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1) {
+    throw evaluation_error("Incorrect number of arguments in function file-size");
+  }
+  String *sp = dynamic_cast<String *>(args.front()->eval(env));
+  if (!sp) {
+    throw evaluation_error(
+        "Invalid argument to function file-size: expected string");
+  }
+  long long size = ::file_size(std::string(sp->val()));
+  if (size < 0) {
+    return env.manage(new Bool(false));
+  }
+  return env.manage(new Number(size));
+}
+
+// the columns of a csv file, built up a row at a time
+struct CsvColumn {
+  std::string chars;
+  std::vector<std::size_t> ends;
+};
+
+// a column is numeric if every field in it that isn't empty is a number.
+// Empty fields in a numeric column are NaN
+static SExp *csv_column(CsvColumn &column, Env &env) {
+  const double missing = std::nan("");
+  std::vector<double> values;
+  values.reserve(column.ends.size());
+  bool numeric = false;
+  std::size_t start = 0;
+  for (auto it = column.ends.begin(); it != column.ends.end(); ++it) {
+    std::string_view field(column.chars.data() + start, *it - start);
+    start = *it;
+    double value = missing;
+    if (!field.empty()) {
+      if (!parse_number(field, value)) {
+        auto chars = std::make_shared<const std::string>(
+            std::move(column.chars));
+        return env.manage(new StringVector(chars, std::move(column.ends)));
+      }
+      numeric = true;
+    }
+    values.push_back(value);
+  }
+  if (!numeric) {
+    auto chars = std::make_shared<const std::string>(std::move(column.chars));
+    return env.manage(new StringVector(chars, std::move(column.ends)));
+  }
+  // the text isn't needed any more, so free it before the next column
+  column = CsvColumn();
+  return env.manage(new NumberVector(std::move(values)));
+}
+
+// the fields of the current row, as numbers where they are numbers
+static SExp *csv_row(CsvReader &reader, Env &env) {
+  std::list<SExp *> fields;
+  for (std::size_t i = 0; i < reader.size(); ++i) {
+    std::string_view field = reader.field(i);
+    double value;
+    if (parse_number(field, value)) {
+      fields.push_back(env.manage(new Number(value)));
+    } else {
+      fields.push_back(env.manage(new String(std::string(field))));
+    }
+  }
+  return env.manage(new List(std::move(fields)));
+}
+
+// (read-csv port) reads a csv file with a header row into columns, returning
+// a list of (name column) pairs. Each column is a vector, of numbers if all
+// its fields are numbers, otherwise of strings.
+// (read-csv port f) instead calls f on each row of the file in turn, as a
+// list of its fields, without keeping them
+SExp *primitive::read_csv(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1 && args.size() != 2) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function read-csv: expected 1 or 2");
+  }
+  std::for_each(args.begin(), args.end(), [&](SExp *&a) { a = a->eval(env); });
+  InPort *ip = dynamic_cast<InPort *>(args.front());
+  if (!ip) {
+    throw evaluation_error(
+        "Invalid first argument to function read-csv: expected port");
+  }
+  CsvReader reader(*ip);
+  if (args.size() == 2) {
+    Function *func = dynamic_cast<Function *>(args.back());
+    if (!func) {
+      throw evaluation_error(
+          "Invalid second argument to function read-csv: expected function");
+    }
+    while (reader.next_row()) {
+      func->call(std::list<SExp *>{quote_var(csv_row(reader, env), env)}, env);
+    }
+    return env.lookup("null");
+  }
+
+  if (!reader.next_row()) {
+    return env.lookup("null");
+  }
+  std::vector<std::string> names;
+  for (std::size_t i = 0; i < reader.size(); ++i) {
+    names.emplace_back(reader.field(i));
+  }
+  std::vector<CsvColumn> columns(names.size());
+  while (reader.next_row()) {
+    if (reader.size() != columns.size()) {
+      std::stringstream msg;
+      msg << "Row " << reader.row() << " of csv file has " << reader.size()
+          << " fields: expected " << columns.size();
+      throw evaluation_error(msg.str());
+    }
+    for (std::size_t i = 0; i < columns.size(); ++i) {
+      std::string_view field = reader.field(i);
+      columns[i].chars.append(field.data(), field.size());
+      columns[i].ends.push_back(columns[i].chars.size());
+    }
+  }
+  std::list<SExp *> table;
+  for (std::size_t i = 0; i < columns.size(); ++i) {
+    SExp *name = env.manage(new String(names[i]));
+    SExp *column = csv_column(columns[i], env);
+    table.push_back(env.manage(new List(std::list<SExp *>{name, column})));
+  }
+  return env.manage(new List(std::move(table)));
+}
+
+SExp *primitive::is_vector(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1) {
+    throw evaluation_error("Incorrect number of arguments in function vector?");
+  }
+  SExp *arg = args.front()->eval(env);
+  bool result = typeid(*arg) == typeid(NumberVector) ||
+                typeid(*arg) == typeid(StringVector);
+  return env.manage(new Bool(result));
+}
+
+// the number of elements in a vector, or -1 if arg isn't one
+static double vector_size(SExp *arg) {
+  if (typeid(*arg) == typeid(NumberVector)) {
+    return static_cast<NumberVector *>(arg)->values.size();
+  } else if (typeid(*arg) == typeid(StringVector)) {
+    return static_cast<StringVector *>(arg)->size();
+  }
+  return -1;
+}
+
+// the i'th element of a vector as a lisp value
+static SExp *vector_element(SExp *vec, std::size_t i, Env &env) {
+  if (typeid(*vec) == typeid(NumberVector)) {
+    return env.manage(new Number(static_cast<NumberVector *>(vec)->values[i]));
+  }
+  auto sv = static_cast<StringVector *>(vec);
+  return env.manage(
+      new String(sv->chars, sv->start(i), sv->ends[i] - sv->start(i)));
+}
+
+SExp *primitive::vector_length(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function vector-length");
+  }
+  SExp *arg = args.front()->eval(env);
+  double size = vector_size(arg);
+  if (size < 0) {
+    throw evaluation_error(
+        "Invalid argument to function vector-length: expected vector");
+  }
+  return env.manage(new Number(size));
+}
+
+SExp *primitive::vector_ref(std::list<SExp *> args, Env &env) {
+  if (args.size() != 2) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function vector-ref");
+  }
+  std::for_each(args.begin(), args.end(), [&](SExp *&a) { a = a->eval(env); });
+  double size = vector_size(args.front());
+  if (size < 0) {
+    throw evaluation_error(
+        "Invalid first argument to function vector-ref: expected vector");
+  }
+  std::size_t i = integer_arg(args.back(), size - 1, "vector-ref");
+  return vector_element(args.front(), i, env);
+}
+
+SExp *primitive::vector_to_list(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function vector->list");
+  }
+  SExp *arg = args.front()->eval(env);
+  double size = vector_size(arg);
+  if (size < 0) {
+    throw evaluation_error(
+        "Invalid argument to function vector->list: expected vector");
+  }
+  std::list<SExp *> elems;
+  for (std::size_t i = 0; i < size; ++i) {
+    elems.push_back(vector_element(arg, i, env));
+  }
+  return env.manage(new List(std::move(elems)));
+}
+
+// The parallel primitives get at the elements of a list or vector by
+// position. A list's elements are copied out first, while the elements of
+// a vector are only made into lisp values by the thread which uses them
+namespace {
+struct Sequence {
+  SExp *vec; // the vector, or null for a list
+  std::vector<SExp *> elems;
+  std::size_t size;
+  SExp *at(std::size_t i, Env &env) {
+    return vec ? vector_element(vec, i, env) : elems[i];
+  }
+};
+}
+
+static Sequence sequence_arg(SExp *arg, const std::string &fn) {
+  List *list = dynamic_cast<List *>(arg);
+  if (list) {
+    return Sequence{nullptr,
+                    std::vector<SExp *>(list->elems.begin(), list->elems.end()),
+                    list->elems.size()};
+  }
+  double size = vector_size(arg);
+  if (size < 0) {
+    throw evaluation_error("Illegal last argument in function " + fn +
+                           ": expected list or vector");
+  }
+  return Sequence{arg, std::vector<SExp *>(), std::size_t(size)};
+}
+
+static Function *function_arg(SExp *arg, const std::string &fn) {
+  Function *func = dynamic_cast<Function *>(arg);
+  if (!func) {
+    throw evaluation_error("Illegal first argument in function " + fn +
+                           ": expected function");
+  }
+  return func;
+}
+
+// (pmap f xs) is (map f xs), but f is applied to the elements on several
+// threads at once, so it shouldn't depend on the order they are done in
+SExp *primitive::pmap(std::list<SExp *> args, Env &env) {
+  if (args.size() != 2) {
+    throw evaluation_error("Incorrect number of arguments in primitive pmap");
+  }
+  std::for_each(args.begin(), args.end(), [&](SExp *&a) { a = a->eval(env); });
+  Function *func = function_arg(args.front(), "pmap");
+  Sequence seq = sequence_arg(args.back(), "pmap");
+  std::vector<SExp *> results(seq.size);
+  env.parallel_for(seq.size, [&func, &seq, &results, &env](std::size_t i) {
+    results[i] =
+        func->call(std::list<SExp *>{quote_var(seq.at(i, env), env)}, env);
+  });
+  return env.manage(
+      new List(std::list<SExp *>(results.begin(), results.end())));
+}
+
+// (pfilter pred xs) is (filter pred xs), testing the elements in parallel
+SExp *primitive::pfilter(std::list<SExp *> args, Env &env) {
+  if (args.size() != 2) {
+    throw evaluation_error(
+        "Incorrect number of arguments in primitive pfilter");
+  }
+  std::for_each(args.begin(), args.end(), [&](SExp *&a) { a = a->eval(env); });
+  Function *pred = function_arg(args.front(), "pfilter");
+  Sequence seq = sequence_arg(args.back(), "pfilter");
+  std::vector<SExp *> values(seq.size);
+  // not vector<bool>, whose elements can't be set from different threads
+  std::vector<char> keep(seq.size);
+  env.parallel_for(seq.size,
+                   [&pred, &seq, &values, &keep, &env](std::size_t i) {
+                     values[i] = seq.at(i, env);
+                     keep[i] = is_true(pred->call(
+                         std::list<SExp *>{quote_var(values[i], env)}, env));
+                   });
+  std::list<SExp *> elements;
+  for (std::size_t i = 0; i < seq.size; ++i) {
+    if (keep[i]) {
+      elements.push_back(values[i]);
+    }
+  }
+  return env.manage(new List(std::move(elements)));
+}
+
+// preduce splits its input into this many runs, at most, which are reduced
+// in parallel. It's several per thread so that the threads can balance the
+// work between them
+static const std::size_t reduce_chunks = 64;
+
+// (preduce f acc xs) gives the same result as (fold f acc xs) as long as f
+// is associative. Each run of elements is reduced separately, without acc,
+// then the results of the runs are folded into acc in order
+SExp *primitive::preduce(std::list<SExp *> args, Env &env) {
+  if (args.size() != 3) {
+    throw evaluation_error(
+        "Incorrect number of arguments in primitive preduce");
+  }
+  std::for_each(args.begin(), args.end(), [&](SExp *&a) { a = a->eval(env); });
+  Function *func = function_arg(args.front(), "preduce");
+  SExp *init = *std::next(args.begin());
+  Sequence seq = sequence_arg(args.back(), "preduce");
+  std::size_t chunks = std::min(seq.size, reduce_chunks);
+  std::vector<SExp *> partial(chunks);
+  auto combine = [&func, &env](SExp *acc, SExp *elem) -> SExp * {
+    return func->call(
+        std::list<SExp *>{quote_var(acc, env), quote_var(elem, env)}, env);
+  };
+  env.parallel_for(chunks, [&](std::size_t c) {
+    std::size_t begin = c * seq.size / chunks;
+    std::size_t end = (c + 1) * seq.size / chunks;
+    SExp *acc = seq.at(begin, env);
+    for (std::size_t i = begin + 1; i < end; ++i) {
+      acc = combine(acc, seq.at(i, env));
+    }
+    partial[c] = acc;
+  });
+  return std::accumulate(partial.begin(), partial.end(), init, combine);
+}
+
+// (spawn f) calls f, a function of no arguments, in a new interpreter on
+// another thread, and returns a future for its result
+SExp *primitive::spawn(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1) {
+    throw evaluation_error("Incorrect number of arguments in function spawn");
+  }
+  SExp *thunk = args.front()->eval(env);
+  function_arg(thunk, "spawn");
+  GlobalEnv &global = env.get_global();
+  auto state = std::make_shared<FutureState>(global, thunk);
+  global.add_spawned(state);
+  return env.manage(new Future(state));
+}
+
+// (touch future) waits for a spawned function to return, and gives its
+// result. If it raised an error, so does touch
+SExp *primitive::touch(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1) {
+    throw evaluation_error("Incorrect number of arguments in function touch");
+  }
+  Future *future = dynamic_cast<Future *>(args.front()->eval(env));
+  if (!future) {
+    throw evaluation_error("Invalid argument to function touch: expected "
+                           "future");
+  }
+  return future->state->touch(env.get_global());
+}
+
+// (make-channel n) makes a channel which holds up to n values
+SExp *primitive::make_channel(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function make-channel");
+  }
+  std::size_t capacity =
+      integer_arg(args.front()->eval(env), 1e9, "make-channel");
+  if (capacity == 0) {
+    throw evaluation_error(
+        "Invalid argument to function make-channel: a channel must hold at "
+        "least one value");
+  }
+  return env.manage(new Channel(std::make_shared<ChannelState>(capacity)));
+}
+
+static ChannelState &channel_arg(SExp *arg, const std::string &fn) {
+  Channel *channel = dynamic_cast<Channel *>(arg);
+  if (!channel) {
+    throw evaluation_error("Invalid first argument to function " + fn +
+                           ": expected channel");
+  }
+  return *channel->state;
+}
+
+// (channel-put ch x) adds a copy of x to the channel, waiting while it's full.
+// A coroutine run by run-coroutines raises an error instead of waiting
+SExp *primitive::channel_put(std::list<SExp *> args, Env &env) {
+  if (args.size() != 2) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function channel-put");
+  }
+  std::for_each(args.begin(), args.end(), [&](SExp *&a) { a = a->eval(env); });
+  channel_arg(args.front(), "channel-put").put(args.back(), env.get_global());
+  return env.lookup("null");
+}
+
+// (channel-get ch) takes the oldest value from the channel, waiting while
+// it's empty. A coroutine run by run-coroutines raises an error instead of
+// waiting
+SExp *primitive::channel_get(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function channel-get");
+  }
+  return channel_arg(args.front()->eval(env), "channel-get")
+      .get(env.get_global());
+}
+
+// (make-coroutine f) makes a coroutine which calls f, a function of no
+// arguments, when it is first resumed
+SExp *primitive::make_coroutine(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function make-coroutine");
+  }
+  SExp *fn = args.front()->eval(env);
+  function_arg(fn, "make-coroutine");
+  return env.manage(
+      new Coroutine(std::make_shared<CoroutineState>(env.get_global(), fn)));
+}
+
+static CoroutineState &coroutine_arg(SExp *arg, const std::string &fn) {
+  Coroutine *coroutine = dynamic_cast<Coroutine *>(arg);
+  if (!coroutine) {
+    throw evaluation_error("Invalid first argument to function " + fn +
+                           ": expected coroutine");
+  }
+  return *coroutine->state;
+}
+
+// (resume co [x]) runs co until it yields or returns, and gives the value it
+// yielded or returned. x, or null, is what the yield co is waiting in gives
+SExp *primitive::resume(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1 && args.size() != 2) {
+    throw evaluation_error("Incorrect number of arguments in function resume");
+  }
+  std::for_each(args.begin(), args.end(), [&](SExp *&a) { a = a->eval(env); });
+  SExp *value = args.size() == 2 ? args.back() : env.lookup("null");
+  return coroutine_arg(args.front(), "resume").resume(value);
+}
+
+// (yield [x]) suspends the coroutine which calls it, making the resume
+// which ran it give x, or null. It gives the value it is next resumed with
+SExp *primitive::yield(std::list<SExp *> args, Env &env) {
+  if (args.size() > 1) {
+    throw evaluation_error("Incorrect number of arguments in function yield");
+  }
+  SExp *value = args.empty() ? env.lookup("null") : args.front()->eval(env);
+  return CoroutineState::yield(value);
+}
+
+// (coroutine-done? co) is true once co has returned
+SExp *primitive::coroutine_done(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function coroutine-done?");
+  }
+  return env.manage(new Bool(
+      coroutine_arg(args.front()->eval(env), "coroutine-done?").finished()));
+}
+
+// (run-coroutines cos) takes turns resuming each coroutine in the list cos,
+// along with any they schedule, until all of them have returned, and gives
+// the list of what the ones in cos returned
+SExp *primitive::run_coroutines(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function run-coroutines");
+  }
+  List *coroutines = dynamic_cast<List *>(args.front()->eval(env));
+  if (!coroutines) {
+    throw evaluation_error("Invalid argument to function run-coroutines: "
+                           "expected list of coroutines");
+  }
+  std::vector<SExp *> results(coroutines->elems.size(), env.lookup("null"));
+  Scheduler scheduler(env);
+  std::size_t i = 0;
+  for (auto it = coroutines->elems.begin(); it != coroutines->elems.end();
+       ++it, ++i) {
+    coroutine_arg(*it, "run-coroutines");
+    scheduler.schedule(*it, &results[i]);
+  }
+  scheduler.run();
+  return env.manage(
+      new List(std::list<SExp *>(results.begin(), results.end())));
+}
+
+// (schedule co) adds co to the coroutines run-coroutines is taking turns
+// between
+SExp *primitive::schedule(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function schedule");
+  }
+  SExp *coroutine = args.front()->eval(env);
+  coroutine_arg(coroutine, "schedule");
+  Scheduler *scheduler = Scheduler::active();
+  if (!scheduler) {
+    throw evaluation_error("Cannot schedule a coroutine outside "
+                           "run-coroutines");
+  }
+  scheduler->schedule(coroutine);
+  return env.lookup("null");
+}
+
+// a list of an input and an output port on the descriptors in fds
+static SExp *port_pair(PortFds fds, const std::string &name, Env &env) {
+  SExp *in = env.manage(new InPort(
+      std::unique_ptr<InputBuffer>(new InputBuffer(fds.in, true)), name));
+  SExp *out = env.manage(new OutPort(
+      std::unique_ptr<std::streambuf>(new OutputBuffer(fds.out, fds.socket)), name));
+  return env.manage(new List(std::list<SExp *>{in, out}));
+}
+
+// (make-pipe) gives a list of an input port and an output port, where
+// whatever is written to the output port can be read from the input port.
+// Coroutines run by run-coroutines which wait for a pipe let the others run
+SExp *primitive::make_pipe(std::list<SExp *> args, Env &env) {
+  if (args.size() != 0) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function make-pipe");
+  }
+  return port_pair(open_pipe(), "pipe", env);
+}
+
+// (make-socket-pair) gives the two ends of a connection, each of them a list
+// of an input port and an output port. What is written to one end's output
+// port is read from the other end's input port
+SExp *primitive::make_socket_pair(std::list<SExp *> args, Env &env) {
+  if (args.size() != 0) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function make-socket-pair");
+  }
+  std::pair<PortFds, PortFds> ends = open_socket_pair();
+  SExp *first = port_pair(ends.first, "socket", env);
+  SExp *second = port_pair(ends.second, "socket", env);
+  return env.manage(new List(std::list<SExp *>{first, second}));
+}
+
+// (connect-socket path) connects to the Unix domain socket at path, giving a
+// list of an input port and an output port, or #f if it can't connect
+SExp *primitive::connect_socket(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function connect-socket");
+  }
+  String *sp = dynamic_cast<String *>(args.front()->eval(env));
+  if (!sp) {
+    throw evaluation_error(
+        "Invalid argument to function connect-socket: expected string");
+  }
+  std::string path(sp->val());
+  try {
+    return port_pair(::connect_socket(path), path, env);
+  } catch (const io_error &) {
+    return env.manage(new Bool(false));
+  }
+}
+
+// (input-ready? port) is true if reading from port won't have to wait
+SExp *primitive::input_ready(std::list<SExp *> args, Env &env) {
+  if (args.size() != 1) {
+    throw evaluation_error(
+        "Incorrect number of arguments in function input-ready?");
+  }
+  InPort *ip = dynamic_cast<InPort *>(args.front()->eval(env));
+  if (!ip) {
+    throw evaluation_error(
+        "Invalid argument to function input-ready?: expected input port");
+  }
+  return env.manage(new Bool(ip->ready()));
+}
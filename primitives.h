@@ -43,8 +43,14 @@ SExp *close_output_port(std::list<SExp *> args, Env &env);
 SExp *open_input_port(std::list<SExp *> args, Env &env);
 SExp *close_input_port(std::list<SExp *> args, Env &env);
 SExp *port_to_string(std::list<SExp *> args, Env &env);
+SExp *open_output_string(std::list<SExp *> args, Env &env);
+SExp *get_output_string(std::list<SExp *> args, Env &env);
+SExp *open_input_string(std::list<SExp *> args, Env &env);
+SExp *read_line(std::list<SExp *> args, Env &env);
+SExp *for_each_line(std::list<SExp *> args, Env &env);
 SExp *display(std::list<SExp *> args, Env &env);
 SExp *displayln(std::list<SExp *> args, Env &env);
+SExp *flush_output(std::list<SExp *> args, Env &env);
 SExp *map(std::list<SExp *> args, Env &env);
 SExp *filter(std::list<SExp *> args, Env &env);
 SExp *fold(std::list<SExp *> args, Env &env);
@@ -52,5 +58,40 @@ SExp *list(std::list<SExp *> args, Env &env);
 SExp *logical_and(std::list<SExp *> args, Env &env);
 SExp *logical_or(std::list<SExp *> args, Env &env);
 SExp *read(std::list<SExp *> args, Env &env);
+SExp *is_eof(std::list<SExp *> args, Env &env);
+SExp *string_length(std::list<SExp *> args, Env &env);
+SExp *substring(std::list<SExp *> args, Env &env);
+SExp *make_bytevector(std::list<SExp *> args, Env &env);
+SExp *is_bytevector(std::list<SExp *> args, Env &env);
+SExp *bytevector_length(std::list<SExp *> args, Env &env);
+SExp *bytevector_u8_ref(std::list<SExp *> args, Env &env);
+SExp *bytevector_u8_set(std::list<SExp *> args, Env &env);
+SExp *read_bytes(std::list<SExp *> args, Env &env);
+SExp *read_bytes_at(std::list<SExp *> args, Env &env);
+SExp *write_bytes(std::list<SExp *> args, Env &env);
+SExp *file_size(std::list<SExp *> args, Env &env);
+SExp *read_csv(std::list<SExp *> args, Env &env);
+SExp *is_vector(std::list<SExp *> args, Env &env);
+SExp *vector_length(std::list<SExp *> args, Env &env);
+SExp *vector_ref(std::list<SExp *> args, Env &env);
+SExp *vector_to_list(std::list<SExp *> args, Env &env);
+SExp *pmap(std::list<SExp *> args, Env &env);
+SExp *pfilter(std::list<SExp *> args, Env &env);
+SExp *preduce(std::list<SExp *> args, Env &env);
+SExp *spawn(std::list<SExp *> args, Env &env);
+SExp *touch(std::list<SExp *> args, Env &env);
+SExp *make_channel(std::list<SExp *> args, Env &env);
+SExp *channel_put(std::list<SExp *> args, Env &env);
+SExp *channel_get(std::list<SExp *> args, Env &env);
+SExp *make_coroutine(std::list<SExp *> args, Env &env);
+SExp *resume(std::list<SExp *> args, Env &env);
+SExp *yield(std::list<SExp *> args, Env &env);
+SExp *coroutine_done(std::list<SExp *> args, Env &env);
+SExp *run_coroutines(std::list<SExp *> args, Env &env);
+SExp *schedule(std::list<SExp *> args, Env &env);
+SExp *make_pipe(std::list<SExp *> args, Env &env);
+SExp *make_socket_pair(std::list<SExp *> args, Env &env);
+SExp *connect_socket(std::list<SExp *> args, Env &env);
+SExp *input_ready(std::list<SExp *> args, Env &env);
 }
 #endif
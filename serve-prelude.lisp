@@ -0,0 +1,7 @@
+;;The prelude of the server make serve-test starts (see serve-test.lisp)
+
+(define square (lambda (x) (* x x)))
+
+;; a generator, which yields lists it has made, and displays what it is resumed with
+(define loop (lambda (x) (loop (car (list (yield (list x x)) (displayln x))))))
+(define gen (make-coroutine (lambda () (loop (list 1 2 3)))))
@@ -0,0 +1,31 @@
+;;This script is a client of a server started with serve-prelude.lisp as its prelude:
+;;	./main --serve serve-test.sock serve-prelude.lisp &
+;;	./main serve-test.lisp serve-test.sock
+;;make serve-test does this. Each request is sent as its name, a blank line and its program,
+;;and the server's answer is displayed
+
+(define request
+	(lambda (name program)
+		(define connection (connect-socket (car (cdr ARGV))))
+		(define in (car connection))
+		(define out (car (cdr connection)))
+		(display name out)
+		(display "\n\n" out)
+		(display program out)
+		(close-output-port out)
+		(display (port->string in))
+		(close-input-port in)))
+
+;; the prelude's functions are used without loading them again
+(request "square" "(displayln (square 7))")
+
+;; a program's definitions aren't seen by the next one
+(request "define" "(define mine 5) (displayln mine)")
+(request "undefined" "(displayln mine)")
+
+;; a coroutine made by the prelude can't be resumed by a program, since what the program
+;; gave it would be left on its stack after the program has finished
+(request "resume" "(resume gen 0) (resume gen (list \"request-one\" 8 9))")
+(request "resume again" "(displayln (resume gen 1))")
+
+(request "last" "(displayln \"still serving\")")
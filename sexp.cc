@@ -1,6 +1,11 @@
+#include "budget.h"
+#include "coroutine.h"
 #include "env.h"
+#include "iobuf.h"
 #include "lisp_exceptions.h"
+#include "parser.h"
 #include "sexp.h"
+#include <charconv>
 #include <fstream>
 #include <list>
 #include <memory>
@@ -18,6 +23,9 @@ bool is_true(SExp *exp) {
 SExp *Atom::eval(Env &env) {
   auto value = env.lookup(id);
   if (value) {
+    // a later definition could leave a coroutine's stack the only thing
+    // referring to the value
+    CoroutineState::hold(value);
     return value;
   } else {
     throw evaluation_error("Encountered undefined atom " + id);
@@ -25,6 +33,9 @@ SExp *Atom::eval(Env &env) {
 }
 
 SExp *List::eval(Env &env) {
+  if (Budget *budget = Budget::active()) {
+    budget->step();
+  }
   if (elems.empty()) {
     throw evaluation_error("Cannot evaluate the empty list");
   }
@@ -41,16 +52,31 @@ SExp *List::eval(Env &env) {
   return result;
 }
 
-SExp *LambdaFunction::call(std::list<SExp *> args, Env &env) {
-  // check the argument list matches the params of the function
-  if (args.size() != params.size()) {
+// the arguments are quoted, so that calling the function evaluates them to
+// themselves
+SExp *Function::apply(SExp *const *args, std::size_t count, Env &env) {
+  SExp *quote = env.lookup("quote");
+  std::list<SExp *> quoted;
+  for (std::size_t i = 0; i < count; ++i) {
+    quoted.push_back(env.manage(new List(std::list<SExp *>{quote, args[i]})));
+  }
+  return call(std::move(quoted), env);
+}
+
+// check the argument list matches the params of the function
+void LambdaFunction::check_arity(std::size_t count) {
+  if (count != params.size()) {
     std::stringstream msg;
     auto repr = Representor(msg);
     msg << "Found mismatched argument list in function ";
     this->exec(repr); // print function name to msg string
-    msg << ", Expected " << params.size() << ", found " << args.size();
+    msg << ", Expected " << params.size() << ", found " << count;
     throw evaluation_error(msg.str());
   }
+}
+
+SExp *LambdaFunction::call(std::list<SExp *> args, Env &env) {
+  check_arity(args.size());
   // make a copy of the captured environment to evaluate the function
   // call, then evaluate the arguments and bind them to the function
   // parameter names in the copied environment
@@ -61,95 +87,223 @@ SExp *LambdaFunction::call(std::list<SExp *> args, Env &env) {
     *arg = (*arg)->eval(env);
     f_env.def(*par, *arg);
   }
+  return run(f_env);
+}
+
+SExp *LambdaFunction::apply(SExp *const *args, std::size_t count, Env &env) {
+  check_arity(count);
+  Env f_env = closure;
+  auto par = params.begin();
+  for (std::size_t i = 0; i < count; ++i, ++par) {
+    f_env.def(*par, args[i]);
+  }
+  return run(f_env);
+}
+
+SExp *LambdaFunction::run(Env &f_env) {
   SExp *result;
+  Budget::Frame frame;
+  CoroutineState::Frame held(f_env);
   // evaluate the body of the function, returning the result of the last
   // expression
   for (auto it = body.begin(); it != body.end(); ++it) {
     result = (*it)->eval(f_env);
   }
-  return result;
+  return held.returning(result);
 }
 
-InPort::InPort(std::string name) : stdin(false), name(name) {
-  file.open(name);
-  if (!file.is_open()) {
-    throw io_error("Cannot open file " + name);
+// only the thread holding the lock stores its own id in owner, so seeing it
+// there means a coroutine on this thread is parked holding the lock
+void PortLock::lock() {
+  if (owner.load(std::memory_order_relaxed) == std::this_thread::get_id()) {
+    throw io_error("Port is in use by a coroutine waiting on it");
   }
+  mutex.lock();
+  owner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+}
+
+void PortLock::unlock() {
+  owner.store(std::thread::id(), std::memory_order_relaxed);
+  mutex.unlock();
 }
 
+InPort::InPort(std::shared_ptr<InputBuffer> buffer,
+               std::shared_ptr<PortLock> lock)
+    : name("stdin"), buffer(std::move(buffer)), stream(this->buffer.get()),
+      lock(std::move(lock)) {}
+
+InPort::InPort(std::string name)
+    : name(name), buffer(new InputBuffer(name)), stream(buffer.get()),
+      lock(std::make_shared<PortLock>()) {}
+
+InPort::InPort(std::unique_ptr<InputBuffer> buffer, std::string name)
+    : name(name), buffer(std::move(buffer)), stream(this->buffer.get()),
+      lock(std::make_shared<PortLock>()) {}
+
 void InPort::close() {
-  if (file.is_open()) {
-    file.close();
-  }
+  std::lock_guard<PortLock> guard(*lock);
+  parser.reset();
+  stream.rdbuf(nullptr);
+  buffer.reset();
 }
 
 InPort::~InPort() { this->close(); }
 
 // read the entire file contents into a string
 SExp *InPort::read(Env &env) {
-  // check the file state is ok before reading
-  if (!stdin) {
-    if (!file.is_open()) {
-      throw io_error("Invalid attempt to read from closed file");
-    } else if (!file.good()) {
-      throw io_error("Found output file in invalid state");
-    }
+  std::lock_guard<PortLock> guard(*lock);
+  if (!buffer) {
+    throw io_error("Invalid attempt to read from closed file");
   }
-  std::istream &in = stdin ? std::cin : file;
-  // this is exploiting the fact that the std::istreambuf_iterator's
-  // default constructor leaves it in the eof state, thus this will read
-  // from the file until eof is reached, constructing str as it does
+  std::string str;
+  buffer->read_all(str);
+  return env.manage(new String(std::move(str)));
+}
 
-  auto str = std::string((std::istreambuf_iterator<char>(in)),
-                         std::istreambuf_iterator<char>());
-  return env.manage(new String(str));
+// lines are read straight out of the buffer. Lines the parser has already
+// started on belong to it, so mixing read and read-line on the same port
+// carries on from the line after the last expression read
+bool InPort::read_line(std::string &line) {
+  std::lock_guard<PortLock> guard(*lock);
+  if (!buffer) {
+    throw io_error("Invalid attempt to read from closed file");
+  }
+  return buffer->read_line(line);
 }
 
 SExp *InPort::read_ln(Env &env) {
-  if (!stdin) {
-    if (!file.is_open()) {
-      throw io_error("Invalid attempt to read from closed file");
-    } else if (!file.good()) {
-      throw io_error("Found output file in invalid state");
-    }
+  std::string line;
+  if (!read_line(line)) {
+    return env.lookup("eof");
   }
-  std::istream &in = stdin ? std::cin : file;
-  std::string str;
-  std::getline(in, str);
-  return env.manage(new String(str));
+  return env.manage(new String(std::move(line)));
 }
 
-OutPort::OutPort(std::string name) : stdoutput(false), name(name) {
-  // we want the file to be open as long as this object exists, so the program
-  // maintains control over the resource
-  file.open(name);
-  if (!file.is_open()) {
-    throw io_error("Cannot open file" + name);
+std::size_t InPort::read_bytes(char *dest, std::size_t count) {
+  std::lock_guard<PortLock> guard(*lock);
+  if (!buffer) {
+    throw io_error("Invalid attempt to read from closed file");
   }
+  return buffer->sgetn(dest, count);
 }
 
-OutPort::~OutPort() { this->close(); }
+std::size_t InPort::read_bytes_at(char *dest, std::size_t count,
+                                  std::size_t offset) {
+  std::lock_guard<PortLock> guard(*lock);
+  if (!buffer) {
+    throw io_error("Invalid attempt to read from closed file");
+  }
+  return buffer->read_at(dest, count, offset);
+}
 
-void OutPort::close() {
-  if (file.is_open()) {
-    file.close();
+bool InPort::ready() {
+  std::lock_guard<PortLock> guard(*lock);
+  if (!buffer) {
+    throw io_error("Invalid attempt to read from closed file");
   }
+  return buffer->ready();
 }
-// write to the file object handled by outstream
-SExp *OutPort::write(std::string str, Env &env) {
-  if (stdoutput) {
-    std::cout << str;
-  } else {
-    if (!file.good())
-      throw io_error("Invalid write to file " + name);
-    if (!file.is_open())
-      throw io_error("Invalid write to closed file " + name);
-    file << str;
+
+// The parser is created on the first read, and reads a line at a time,
+// dropping lines it has finished with, so a file of any size can be read an
+// expression at a time
+SExp *InPort::read_sexp(Env &env) {
+  std::lock_guard<PortLock> guard(*lock);
+  if (!buffer) {
+    throw io_error("Invalid attempt to read from closed file");
+  }
+  if (!parser) {
+    parser.reset(new Parser(stream, ParseMode::data));
+  }
+  SExp *exp = parser->read_sexp(env);
+  return exp ? exp : env.lookup("eof");
+}
+
+OutPort::OutPort(std::ostream &console, std::shared_ptr<PortLock> lock)
+    : name("stdout"), out(console.rdbuf()), closed(false),
+      lock(std::move(lock)) {}
+
+OutPort::OutPort(std::string name)
+    : OutPort(std::unique_ptr<std::streambuf>(new OutputBuffer(name)), name) {}
+
+OutPort::OutPort(std::unique_ptr<std::streambuf> buffer, std::string name)
+    : name(name), buffer(std::move(buffer)), out(this->buffer.get()),
+      closed(false), lock(std::make_shared<PortLock>()) {}
+
+void OutPort::redirect(std::ostream &console) {
+  std::lock_guard<PortLock> guard(*lock);
+  out.rdbuf(console.rdbuf());
+}
+
+bool OutPort::is_string_port() {
+  return dynamic_cast<std::stringbuf *>(buffer.get()) != nullptr;
+}
+
+// a string port keeps what was written to it after it is closed
+std::string OutPort::contents() {
+  std::lock_guard<PortLock> guard(*lock);
+  auto text = dynamic_cast<std::stringbuf *>(buffer.get());
+  if (!text) {
+    throw io_error("Cannot get the contents of file port " + name);
   }
-  return env.lookup("null");
+  return text->str();
 }
 
-void Representor::visit(Number &number) { stream << number.val(); }
+// standard output is left for the interpreter to flush when it exits
+OutPort::~OutPort() {
+  if (buffer) {
+    this->close();
+  }
+}
+
+std::ostream &OutPort::stream() {
+  if (closed) {
+    throw io_error("Invalid write to closed file " + name);
+  }
+  if (!out.good()) {
+    throw io_error("Invalid write to file " + name);
+  }
+  return out;
+}
+
+void OutPort::write_bytes(const char *src, std::size_t count) {
+  std::lock_guard<PortLock> guard(*lock);
+  if (!stream().write(src, count)) {
+    throw io_error("Invalid write to file " + name);
+  }
+}
+
+void OutPort::flush() {
+  std::lock_guard<PortLock> guard(*lock);
+  if (!closed) {
+    out.flush();
+  }
+}
+
+// closing standard output only flushes it, since the interpreter still uses
+// it
+void OutPort::close() {
+  std::lock_guard<PortLock> guard(*lock);
+  if (!closed) {
+    out.flush();
+  }
+  if (buffer) {
+    closed = true;
+    auto file = dynamic_cast<OutputBuffer *>(buffer.get());
+    if (file) {
+      file->close();
+    }
+  }
+}
+
+// formatted the same way as stream << number.val(), but without going
+// through the stream's locale
+void Representor::visit(Number &number) {
+  char buf[32];
+  auto result = std::to_chars(buf, buf + sizeof(buf), number.val(),
+                              std::chars_format::general, stream.precision());
+  stream.write(buf, result.ptr - buf);
+}
 void Representor::visit(String &string) {
   stream << "\"";
   stream << string.val();
@@ -202,6 +356,48 @@ void Representor::visit(OutPort &out) {
   stream << "< output-port " << out.get_name() << ">";
 }
 
+void Representor::visit(Eof &eof) { stream << "#<eof>"; }
+
+void Representor::visit(Future &future) { stream << "#<future>"; }
+
+void Representor::visit(Channel &channel) { stream << "#<channel>"; }
+
+void Representor::visit(Coroutine &coroutine) { stream << "#<coroutine>"; }
+
+void Representor::visit(Bytevector &bytes) {
+  // e.g #u8(1 2 255)
+  stream << "#u8(";
+  for (auto it = bytes.bytes.begin(); it != bytes.bytes.end(); ++it) {
+    if (it != bytes.bytes.begin()) {
+      stream << " ";
+    }
+    stream << int(*it);
+  }
+  stream << ")";
+}
+
+void Representor::visit(NumberVector &vec) {
+  stream << "#(";
+  for (std::size_t i = 0; i < vec.values.size(); ++i) {
+    if (i != 0) {
+      stream << " ";
+    }
+    Number(vec.values[i]).exec(*this);
+  }
+  stream << ")";
+}
+
+void Representor::visit(StringVector &vec) {
+  stream << "#(";
+  for (std::size_t i = 0; i < vec.size(); ++i) {
+    if (i != 0) {
+      stream << " ";
+    }
+    stream << "\"" << vec.at(i) << "\"";
+  }
+  stream << ")";
+}
+
 // specialised version for printing the literal content of strings
 void DisplayRepresentor::visit(String &string) { stream << string.val(); }
 
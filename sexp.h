@@ -2,13 +2,20 @@
 #define SEXP_H
 
 #include "env.h"
+#include <atomic>
+#include <cstdint>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <list>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 // This header file is the core of the language, defining the allowed builtin
 // types
 // All valid LISP expressions are s-expressions,
@@ -29,6 +36,19 @@ class PrimitiveFunction;
 class LambdaFunction;
 class InPort;
 class OutPort;
+class Eof;
+class Bytevector;
+class NumberVector;
+class StringVector;
+class Future;
+class Channel;
+class Coroutine;
+class FutureState;
+class ChannelState;
+class CoroutineState;
+class Parser;
+class InputBuffer;
+class OutputBuffer;
 
 bool is_true(SExp *);
 // Visitor function. This allows classes that recurse through sexp
@@ -45,6 +65,13 @@ public:
   virtual void visit(LambdaFunction &lambda) = 0;
   virtual void visit(InPort &in) = 0;
   virtual void visit(OutPort &out) = 0;
+  virtual void visit(Eof &eof) = 0;
+  virtual void visit(Bytevector &bytes) = 0;
+  virtual void visit(NumberVector &vec) = 0;
+  virtual void visit(StringVector &vec) = 0;
+  virtual void visit(Future &future) = 0;
+  virtual void visit(Channel &channel) = 0;
+  virtual void visit(Coroutine &coroutine) = 0;
 };
 
 // Abstract class for language objects
@@ -68,9 +95,9 @@ template <typename T> class PrimitiveType : public SExp {
   const T value;
 
 public:
-  PrimitiveType<T>(T value) : value(value) {}
+  PrimitiveType<T>(T value) : value(std::move(value)) {}
   ~PrimitiveType() {}
-  T val() { return value; }
+  const T &val() const { return value; }
   virtual SExp *eval(Env &env) override { return this; }
 };
 
@@ -80,9 +107,30 @@ public:
   void exec(SExpVisitor &visitor) override { visitor.visit(*this); }
 };
 
-class String : public PrimitiveType<std::string> {
+// Strings are immutable, so they can share their characters: a string is a
+// view of part of a reference counted buffer. Copying a string, or taking a
+// substring of it, shares the buffer instead of copying the characters
+class String : public SExp {
+private:
+  std::shared_ptr<const std::string> buffer;
+  std::size_t start;
+  std::size_t length;
+
 public:
-  String(std::string str) : PrimitiveType<std::string>(str) {}
+  String(std::string str)
+      : buffer(std::make_shared<const std::string>(std::move(str))), start(0),
+        length(buffer->size()) {}
+  // the count characters of str starting at from
+  String(const String &str, std::size_t from, std::size_t count)
+      : buffer(str.buffer), start(str.start + from), length(count) {}
+  // the count characters of buffer starting at from
+  String(std::shared_ptr<const std::string> buffer, std::size_t from,
+         std::size_t count)
+      : buffer(std::move(buffer)), start(from), length(count) {}
+  std::string_view val() const {
+    return std::string_view(*buffer).substr(start, length);
+  }
+  SExp *eval(Env &env) override { return this; }
   void exec(SExpVisitor &visitor) override { visitor.visit(*this); }
 };
 
@@ -113,7 +161,7 @@ private:
 
 class List : public SExp {
 public:
-  List(std::list<SExp *> list) : elems(list) {}
+  List(std::list<SExp *> list) : elems(std::move(list)) {}
   void exec(SExpVisitor &visitor) override { visitor.visit(*this); }
   const std::list<SExp *> elems;
   virtual SExp *eval(Env &env) override;
@@ -125,6 +173,8 @@ public:
 class Function : public SExp {
 public:
   virtual SExp *call(std::list<SExp *>, Env &) = 0;
+  // call the function on count arguments which have already been evaluated
+  virtual SExp *apply(SExp *const *args, std::size_t count, Env &env);
   virtual ~Function() {}
 };
 
@@ -155,33 +205,77 @@ private:
   const std::list<std::string> params;
   std::list<SExp *> body;
   const Env closure;
+  void check_arity(std::size_t count);
+  // evaluate the body in f_env, which binds the parameters
+  SExp *run(Env &f_env);
 
 public:
   LambdaFunction(Env env, std::list<std::string> params, std::list<SExp *> body)
-      : closure(env), params(params), body(body) {}
+      : closure(std::move(env)), params(std::move(params)),
+        body(std::move(body)) {}
   virtual SExp *call(std::list<SExp *> args, Env &env) override;
+  // bind the arguments straight to the parameters, with nothing to evaluate
+  SExp *apply(SExp *const *args, std::size_t count, Env &env) override;
   void exec(SExpVisitor &visitor) override { visitor.visit(*this); }
   SExp *eval(Env &env) override { return this; }
   ~LambdaFunction() override {}
   friend class Heap; // needs to access the env and body of lambdas for
                      // garbage collection
+  friend class ImageWriter;
+  friend class ImageReader;
 
   friend class Representor;
 };
 
 // Handles to input and output streams
 
+// Locks a port while it is read or written. A coroutine that waits on a pipe
+// or socket is parked holding its port's lock, so another coroutine on the
+// same thread taking the lock would wait for itself: that raises io_error
+// instead. Threads other than the owner just wait for the lock as usual
+class PortLock {
+private:
+  std::mutex mutex;
+  std::atomic<std::thread::id> owner;
+
+public:
+  void lock();
+  void unlock();
+};
+
 class InPort : public SExp {
 private:
   std::string name;
-  bool stdin;
-  std::ifstream file;
+  std::shared_ptr<InputBuffer> buffer; // null once the port is closed
+  std::istream stream;                 // reads from buffer
+  // reads data from the port. It holds on to the rest of the line the last
+  // expression ended on, so it is kept between calls to read_sexp
+  std::unique_ptr<Parser> parser;
+  // parallel primitives may read from the same port on several threads.
+  // Ports reading standard input share its lock
+  std::shared_ptr<PortLock> lock;
 
 public:
-  InPort() : stdin(true) {}
+  // read standard input through buffer, which the repl reads through too
+  InPort(std::shared_ptr<InputBuffer> buffer, std::shared_ptr<PortLock> lock);
   InPort(std::string name);
+  // read from the given buffer, like the text of a string
+  InPort(std::unique_ptr<InputBuffer> buffer, std::string name);
+  // read the rest of the input into a string
   SExp *read(Env &env);
+  // read the next line as a string, or eof if there are none left
   SExp *read_ln(Env &env);
+  // read the next line into line, returning false if there are none left
+  bool read_line(std::string &line);
+  // read the next expression from the port, or eof if there are none left
+  SExp *read_sexp(Env &env);
+  // read up to count bytes into dest, returning how many were read. Large
+  // reads bypass the port's buffer
+  std::size_t read_bytes(char *dest, std::size_t count);
+  // read up to count bytes from offset in the file, without moving the port
+  std::size_t read_bytes_at(char *dest, std::size_t count, std::size_t offset);
+  // whether there is input to read without waiting, or the port is at eof
+  bool ready();
   SExp *eval(Env &env) override { return this; }
   void exec(SExpVisitor &visitor) override { visitor.visit(*this); }
   std::string get_name() { return name; }
@@ -191,14 +285,33 @@ public:
 
 class OutPort : public SExp {
 private:
-  std::ofstream file;
-  bool stdoutput;
   std::string name;
+  std::unique_ptr<std::streambuf> buffer; // null for standard output
+  std::ostream out;
+  bool closed;
+  // serialises writes from parallel primitives running on several threads.
+  // Interpreters which share a console share its lock too
+  std::shared_ptr<PortLock> lock;
 
 public:
-  OutPort() : stdoutput(true), name("stdout") {}
+  // write to the interpreter's standard output, through the same buffer as
+  // console
+  OutPort(std::ostream &console, std::shared_ptr<PortLock> lock);
   OutPort(std::string name);
-  SExp *write(std::string, Env &env);
+  // write into the given buffer, like a growable string
+  OutPort(std::unique_ptr<std::streambuf> buffer, std::string name);
+  // whether the port writes into a string, and what it has written
+  bool is_string_port();
+  std::string contents();
+  // write count bytes from src. Large writes bypass the port's buffer
+  void write_bytes(const char *src, std::size_t count);
+  // the stream to write to. Output is buffered until the port is flushed or
+  // closed. Whatever writes to it directly should hold get_lock() meanwhile
+  std::ostream &stream();
+  PortLock &get_lock() { return *lock; }
+  // write standard output to console from now on
+  void redirect(std::ostream &console);
+  void flush();
   SExp *eval(Env &env) override { return this; }
   void exec(SExpVisitor &visitor) override { visitor.visit(*this); }
   std::string get_name() { return name; }
@@ -206,6 +319,79 @@ public:
   ~OutPort();
 };
 
+// The value returned by reading past the end of an input port. There is only
+// one, bound to eof in the global scope
+class Eof : public SExp {
+public:
+  SExp *eval(Env &env) override { return this; }
+  void exec(SExpVisitor &visitor) override { visitor.visit(*this); }
+};
+
+// A fixed size, mutable array of bytes, for binary data
+class Bytevector : public SExp {
+public:
+  Bytevector(std::size_t size, std::uint8_t fill) : bytes(size, fill) {}
+  Bytevector(std::vector<std::uint8_t> bytes) : bytes(std::move(bytes)) {}
+  std::vector<std::uint8_t> bytes;
+  SExp *eval(Env &env) override { return this; }
+  void exec(SExpVisitor &visitor) override { visitor.visit(*this); }
+};
+
+// Vectors hold a column of values unboxed, so that a large table is a few
+// objects rather than one per value. They are built by read-csv
+class NumberVector : public SExp {
+public:
+  NumberVector(std::vector<double> values) : values(std::move(values)) {}
+  std::vector<double> values;
+  SExp *eval(Env &env) override { return this; }
+  void exec(SExpVisitor &visitor) override { visitor.visit(*this); }
+};
+
+// The strings in a string vector are stored end to end in one buffer, which
+// the strings taken from it share
+class StringVector : public SExp {
+public:
+  StringVector(std::shared_ptr<const std::string> chars,
+               std::vector<std::size_t> ends)
+      : chars(std::move(chars)), ends(std::move(ends)) {}
+  std::shared_ptr<const std::string> chars;
+  std::vector<std::size_t> ends; // where each string ends in chars
+  std::size_t size() const { return ends.size(); }
+  std::size_t start(std::size_t i) const { return i == 0 ? 0 : ends[i - 1]; }
+  std::string_view at(std::size_t i) const {
+    return std::string_view(*chars).substr(start(i), ends[i] - start(i));
+  }
+  SExp *eval(Env &env) override { return this; }
+  void exec(SExpVisitor &visitor) override { visitor.visit(*this); }
+};
+
+// A value being worked out by another interpreter on another thread, and a
+// queue for passing values between interpreters (see future.h)
+class Future : public SExp {
+public:
+  Future(std::shared_ptr<FutureState> state) : state(std::move(state)) {}
+  std::shared_ptr<FutureState> state;
+  SExp *eval(Env &env) override { return this; }
+  void exec(SExpVisitor &visitor) override { visitor.visit(*this); }
+};
+
+class Channel : public SExp {
+public:
+  Channel(std::shared_ptr<ChannelState> state) : state(std::move(state)) {}
+  std::shared_ptr<ChannelState> state;
+  SExp *eval(Env &env) override { return this; }
+  void exec(SExpVisitor &visitor) override { visitor.visit(*this); }
+};
+
+// A function call which can be suspended and carried on (see coroutine.h)
+class Coroutine : public SExp {
+public:
+  Coroutine(std::shared_ptr<CoroutineState> state) : state(std::move(state)) {}
+  std::shared_ptr<CoroutineState> state;
+  SExp *eval(Env &env) override { return this; }
+  void exec(SExpVisitor &visitor) override { visitor.visit(*this); }
+};
+
 // The representor class is used to write the s-expressions to a stream. It is
 // written using the 'visitor pattern', a way of decoupling operations on
 // classes from the object structure. By calling sexp->exec(*this), a visitor
@@ -227,6 +413,13 @@ public:
   void visit(LambdaFunction &lambda);
   void visit(InPort &in);
   void visit(OutPort &out);
+  void visit(Eof &eof);
+  void visit(Bytevector &bytes);
+  void visit(NumberVector &vec);
+  void visit(StringVector &vec);
+  void visit(Future &future);
+  void visit(Channel &channel);
+  void visit(Coroutine &coroutine);
 };
 
 // implement the stream insertion operator for sexps using the representor class
@@ -55,6 +55,7 @@
 		'(eq? "hi" (lambda (x) (* x 2)))
 		'(eq? "this" "this")
 		'(eq? #t #f)
+		'(eq? 0 (* -1 0))
 		'(null? 4)
 		'(null? "null")
 		'(null? null)
@@ -139,6 +140,72 @@
 				(close-input-port f)
 		 ))
 		 
+		 ;; string ports read from and write into strings
+		 '((lambda ()
+		 		(define out (open-output-string))
+				(display "written to " out)
+				(display "a string" out)
+				(get-output-string out)
+		 ))
+		 '(read-line (open-input-string "first line\nsecond line"))
+		 '(read (open-input-string "(a list (read back) 42)"))
+
+		 ;; bytevectors
+		 '((lambda ()
+		 		(define bv (make-bytevector 4 7))
+				(bytevector-u8-set! bv 0 255)
+				(list (bytevector? bv) (bytevector-length bv) (bytevector-u8-ref bv 0) (bytevector-u8-ref bv 3))
+		 ))
+
+		 ;; csv files are read into a column per header, each of them a vector
+		 '(read-csv (open-input-string "name,age\nAda,36\nAlan,41\n"))
+		 '(vector->list (car (cdr (car (cdr (read-csv (open-input-string "name,age\nAda,36\nAlan,41\n")))))))
+
+		 ;; parallel versions of map, filter and fold
+		 '(pmap (lambda (x) (* x x)) '(1 2 3 4 5 6 7 8 9 10))
+		 '(pfilter (lambda (x) (= (% x 2) 0)) '(1 2 3 4 5 6 7 8 9 10))
+		 '(preduce + 0 '(1 2 3 4 5 6 7 8 9 10))
+
+		 ;; spawned functions run in interpreters of their own, and can talk over channels
+		 '(touch (spawn (lambda () (* 6 7))))
+		 '((lambda ()
+		 		(define ch (make-channel 2))
+				(define sender (spawn (lambda () (channel-put ch "ping") (channel-put ch "pong") "sent")))
+				(list (channel-get ch) (channel-get ch) (touch sender))
+		 ))
+
+		 ;; coroutines
+		 '((lambda ()
+		 		(define counter (make-coroutine (lambda () (yield 1) (yield 2) 3)))
+				(list (resume counter) (resume counter) (resume counter) (coroutine-done? counter))
+		 ))
+		 '(run-coroutines (list
+		 		(make-coroutine (lambda () (displayln "first, part 1") (yield) (displayln "first, part 2") 1))
+				(make-coroutine (lambda () (displayln "second, part 1") (yield) (displayln "second, part 2") 2))))
+		 ;; coroutines run-coroutines runs can't wait for a channel, but can use one which is ready
+		 '((lambda ()
+		 		(define ch (make-channel 1))
+				(run-coroutines (list
+					(make-coroutine (lambda () (channel-put ch "handed over")))
+					(make-coroutine (lambda () (channel-get ch)))))
+		 ))
+
+		 ;; pipes and sockets: a coroutine waiting to read lets the others run
+		 '((lambda ()
+		 		(define pipe (make-pipe))
+				(run-coroutines (list
+					(make-coroutine (lambda () (read-line (car pipe))))
+					(make-coroutine (lambda ()
+						(displayln "through a pipe" (car (cdr pipe)))
+						(flush-output (car (cdr pipe)))))))
+		 ))
+		 '((lambda ()
+		 		(define ends (make-socket-pair))
+				(displayln "through a socket" (car (cdr (car ends))))
+				(flush-output (car (cdr (car ends))))
+				(read-line (car (car (cdr ends))))
+		 ))
+
 		 ;;display command line arguments and program name
 		 '((lambda ()
 		 	(displayln ARGV)